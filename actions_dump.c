@@ -16,6 +16,8 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <string.h>
+#include <time.h>
+#include <setjmp.h>
 
 #ifndef LIBUSB_DETACH
 /* detach the device from crappy kernel drivers */
@@ -24,12 +26,27 @@
 
 #if USE_LIBUSB
 #include <libusb-1.0/libusb.h>
+#include <pthread.h>
 #else
 #include <termios.h>
-#include <fcntl.h>
 #include <poll.h>
+#include <linux/netlink.h>
 #endif
 #include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
+#ifdef __linux__
+#include <sys/socket.h>
+#include <sys/un.h>
+#endif
+
+#ifndef O_CLOEXEC
+#define O_CLOEXEC 0
+#endif
 
 static void print_mem(FILE *f, const uint8_t *buf, size_t len) {
 	size_t i; int a, j, n;
@@ -68,26 +85,183 @@ static void print_string(FILE *f, uint8_t *buf, size_t n) {
 	fprintf(f, "\"\n");
 }
 
+/*
+ * With several devices, each worker has its own log and output file
+ * prefix, and an error stops only the worker. The helper threads (USB
+ * events, dump writer) catch their errors and report them to the worker.
+ */
+static __thread FILE *log_file;
+static __thread jmp_buf *err_jmp;
+static __thread const char *out_prefix;
+
+#define LOG_FILE (log_file ? log_file : stderr)
+#define OUT_FILE (log_file ? log_file : stdout)
+
+static void err_exit(void) {
+	if (err_jmp) longjmp(*err_jmp, 1);
+	exit(1);
+}
+
 #define ERR_EXIT(...) \
-	do { fprintf(stderr, __VA_ARGS__); exit(1); } while (0)
+	do { fprintf(LOG_FILE, __VA_ARGS__); err_exit(); } while (0)
+
+#define DBG_LOG(...) fprintf(LOG_FILE, __VA_ARGS__)
+
+/*
+ * Transfer errors, the script reconnects and retries
+ * the command if it's running one that can continue.
+ */
+enum { XFER_TIMEOUT = 1, XFER_GONE };
+
+static __thread jmp_buf *xfer_jmp;
+
+static void xfer_exit(int kind) {
+	if (xfer_jmp) longjmp(*xfer_jmp, kind);
+	err_exit();
+}
+
+#define XFER_EXIT(kind, ...) \
+	do { fprintf(LOG_FILE, __VA_ARGS__); xfer_exit(kind); } while (0)
+
+static uint64_t get_time_usec(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * --trace <file>: timed spans in the Chrome trace event format
+ * (chrome://tracing, Perfetto). Threads append the events to a buffer
+ * allocated at the start without locks, the file is written at exit
+ * (also after an error). Other threads may still run at exit, so the
+ * buffer is never freed and only the completed events are written.
+ */
+
+#define TRACE_MAX (1 << 20)
+#define TRACE_THREADS 64
+
+typedef struct {
+	uint64_t ts, dur;
+	const char *name;
+	uint32_t arg, len;
+	int tid, ready;
+} trace_event_t;
+
+static trace_event_t *trace_buf;
+static unsigned trace_count;
+static uint64_t trace_start;
+static const char *trace_fn;
+static int trace_tids;
+static char *trace_names[TRACE_THREADS];
+static __thread int trace_tid;
+
+// names the calling thread in the trace
+static void trace_thread(const char *name) {
+	int i;
+	if (!trace_buf || trace_tid) return;
+	trace_tid = i = __atomic_add_fetch(&trace_tids, 1, __ATOMIC_RELAXED);
+	if (i < TRACE_THREADS)
+		__atomic_store_n(&trace_names[i], strdup(name), __ATOMIC_RELEASE);
+}
+
+static void trace_span(const char *name,
+		uint64_t start, uint64_t end, uint32_t arg, uint32_t len) {
+	trace_event_t *e; unsigned i;
+	if (!trace_buf) return;
+	i = __atomic_fetch_add(&trace_count, 1, __ATOMIC_RELAXED);
+	if (i >= TRACE_MAX) return;
+	e = trace_buf + i;
+	e->ts = start;
+	e->dur = end - start;
+	e->name = name;
+	e->arg = arg;
+	e->len = len;
+	e->tid = trace_tid;
+	__atomic_store_n(&e->ready, 1, __ATOMIC_RELEASE);
+}
+
+static void trace_write(void) {
+	unsigned i, n = __atomic_load_n(&trace_count, __ATOMIC_RELAXED);
+	int tids = __atomic_load_n(&trace_tids, __ATOMIC_RELAXED);
+	FILE *f;
+	if (!trace_buf) return;
+	f = fopen(trace_fn, "w");
+	if (!f) {
+		DBG_LOG("fopen(\"%s\") failed\n", trace_fn);
+		return;
+	}
+	if (n > TRACE_MAX) {
+		DBG_LOG("trace: %u events dropped\n", n - TRACE_MAX);
+		n = TRACE_MAX;
+	}
+	fprintf(f, "{\"traceEvents\": [");
+	for (i = 1; i <= (unsigned)tids && i < TRACE_THREADS; i++) {
+		const char *name = __atomic_load_n(&trace_names[i], __ATOMIC_ACQUIRE);
+		fprintf(f, "%s\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, "
+				"\"tid\": %u, \"args\": {\"name\": \"%s\"}}",
+				i > 1 ? "," : "", i, name ? name : "");
+	}
+	for (i = 0; i < n; i++) {
+		trace_event_t *e = trace_buf + i;
+		// still being filled by another thread
+		if (!__atomic_load_n(&e->ready, __ATOMIC_ACQUIRE)) continue;
+		fprintf(f, ",\n{\"name\": \"%s\", \"ph\": \"X\", \"ts\": %llu, "
+				"\"dur\": %llu, \"pid\": 1, \"tid\": %d, "
+				"\"args\": {\"arg\": \"0x%x\", \"len\": %u}}",
+				e->name, (long long)(e->ts - trace_start),
+				(long long)e->dur, e->tid, e->arg, e->len);
+	}
+	fprintf(f, "\n]}\n");
+	fclose(f);
+}
 
-#define DBG_LOG(...) fprintf(stderr, __VA_ARGS__)
+static void trace_init(const char *fn) {
+	trace_buf = (trace_event_t*)calloc(TRACE_MAX, sizeof(trace_event_t));
+	if (!trace_buf) ERR_EXIT("malloc failed\n");
+	trace_fn = fn;
+	trace_start = get_time_usec();
+	trace_thread("main");
+	atexit(trace_write);
+}
 
 #define RECV_BUF_LEN 1024
 #define TEMP_BUF_LEN (64 << 10)
 
+typedef struct usb_async usb_async_t;
+typedef struct usb_stats usb_stats_t;
+
+// bus-port.port...
+#define USB_PATH_LEN 40
+
 typedef struct {
 	uint8_t *recv_buf, *buf;
+	usb_async_t *async;
+	usb_stats_t *stats;
 #if USE_LIBUSB
 	libusb_device_handle *dev_handle;
 	int endp_in, endp_out;
+	// to open the device again
+	int id_vendor, id_product;
+	char path[USB_PATH_LEN];
 #else
 	int serial;
+	const char *tty;
 #endif
 	int flags, recv_len, recv_pos, nread;
 	int verbose, timeout;
+	uint32_t scsi_tag;
+	int chip;
+	// the code started by "switch" (adfus) handles the commands
+	int switched;
+	// the device has gone and didn't come back
+	int gone;
+	// the synchronous command being timed (--stats, --trace)
+	int sync_key; uint32_t sync_len;
+	uint64_t sync_time[2];
 } usbio_t;
 
+#define USB_TIMED(io) ((io)->stats || trace_buf)
+
 #if USE_LIBUSB
 static void find_endpoints(libusb_device_handle *dev_handle, int result[2]) {
 	int endp_in = -1, endp_out = -1;
@@ -174,6 +348,9 @@ static void init_serial(int serial) {
 }
 #endif
 
+static usb_stats_t* usb_stats_new(void);
+static void usb_stats_free(usbio_t *io);
+
 #if USE_LIBUSB
 static usbio_t* usbio_init(libusb_device_handle *dev_handle, int flags) {
 #else
@@ -198,20 +375,34 @@ static usbio_t* usbio_init(int serial, int flags) {
 	io->dev_handle = dev_handle;
 	io->endp_in = endpoints[0];
 	io->endp_out = endpoints[1];
+	io->id_vendor = io->id_product = 0;
+	io->path[0] = 0;
 #else
 	io->serial = serial;
+	io->tty = NULL;
 #endif
+	io->async = NULL;
+	io->stats = usb_stats_new();
 	io->recv_len = 0;
 	io->recv_pos = 0;
 	io->recv_buf = p; p += RECV_BUF_LEN;
 	io->buf = p;
 	io->verbose = 0;
 	io->timeout = 1000;
+	io->scsi_tag = 1;
+	io->chip = 0;
+	io->switched = 0;
+	io->gone = 0;
+	io->sync_key = -1;
 	return io;
 }
 
+static void usb_async_free(usbio_t *io);
+
 static void usbio_free(usbio_t* io) {
 	if (!io) return;
+	usb_async_free(io);
+	usb_stats_free(io);
 #if USE_LIBUSB
 	libusb_close(io->dev_handle);
 #else
@@ -244,34 +435,258 @@ static void usbio_free(usbio_t* io) {
 	((uint8_t*)(p))[1] << 8 | \
 	((uint8_t*)(p))[0])
 
-static int usb_send(usbio_t *io, const void *data, int len) {
-	const uint8_t *buf = (const uint8_t*)data;
-	int ret;
+/*
+ * --pcap <file>: the transfers in the usbmon format of Linux
+ * (LINKTYPE_USB_LINUX_MMAPPED) for Wireshark, the submission record
+ * has the sent data and the completion record has the received data.
+ * The records are collected in one of two buffers, the filled buffer
+ * is written by a thread in the libusb build.
+ */
 
-	if (!buf) buf = io->buf;
-	if (!len) ERR_EXIT("empty message\n");
+#define PCAP_BUF_LEN (4 << 20)
+#define PCAP_LINKTYPE 220
+
+#if USE_LIBUSB
+#define PCAP_EP_IN(io) (io)->endp_in
+#define PCAP_EP_OUT(io) (io)->endp_out
+#else
+#define PCAP_EP_IN(io) 0x81
+#define PCAP_EP_OUT(io) 0x01
+#endif
+
+typedef struct {
+	uint64_t id;
+	uint8_t type, xfer_type, epnum, devnum;
+	uint16_t busnum;
+	char flag_setup, flag_data;
+	int64_t ts_sec;
+	int32_t ts_usec, status;
+	uint32_t length, len_cap;
+	uint8_t setup[8];
+	int32_t interval, start_frame;
+	uint32_t xfer_flags, ndesc;
+} pcap_usb_t;
+
+typedef struct {
+	int fd, error, cur;
+	uint8_t *buf[2];
+	size_t len[2];
+#if USE_LIBUSB
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	// the other buffer is being written
+	int busy, stop;
+#endif
+} pcap_writer_t;
+
+static pcap_writer_t *pcap;
+// for the synchronous transfers
+static uint64_t pcap_id;
+
+static int pcap_put(int fd, const uint8_t *buf, size_t n) {
+	ssize_t k;
+	for (; n; n -= k, buf += k)
+		if ((k = write(fd, buf, n)) <= 0) return -1;
+	return 0;
+}
+
+#if USE_LIBUSB
+static void* pcap_main(void *arg) {
+	pcap_writer_t *p = (pcap_writer_t*)arg;
+	pthread_mutex_lock(&p->mutex);
+	for (;;) {
+		int i, err = p->error;
+		while (!p->busy && !p->stop)
+			pthread_cond_wait(&p->cond, &p->mutex);
+		if (!p->busy) break;
+		i = p->cur ^ 1;
+		pthread_mutex_unlock(&p->mutex);
+		if (!err) err = pcap_put(p->fd, p->buf[i], p->len[i]);
+		pthread_mutex_lock(&p->mutex);
+		p->error = err;
+		p->len[i] = 0;
+		p->busy = 0;
+		pthread_cond_broadcast(&p->cond);
+	}
+	pthread_mutex_unlock(&p->mutex);
+	return NULL;
+}
+#endif
+
+// hands over the filled buffer
+static void pcap_swap(pcap_writer_t *p) {
+#if USE_LIBUSB
+	while (p->busy) pthread_cond_wait(&p->cond, &p->mutex);
+	p->cur ^= 1;
+	p->busy = 1;
+	pthread_cond_broadcast(&p->cond);
+#else
+	if (!p->error) p->error = pcap_put(p->fd, p->buf[0], p->len[0]);
+	p->len[0] = 0;
+#endif
+}
+
+/*
+ * Adds a record of type 'S' (submission) or 'C' (completion),
+ * "len" is the requested or transferred length, "data" is NULL
+ * if the record doesn't have the data.
+ */
+static void pcap_urb(usbio_t *io, uint64_t id, int type, int ep,
+		const void *data, uint32_t len, int status) {
+	pcap_usb_t h; uint32_t rec[4];
+	uint32_t cap = data ? len : 0, max = PCAP_BUF_LEN - sizeof(rec) - sizeof(h);
+	struct timespec ts;
+	pcap_writer_t *p = __atomic_load_n(&pcap, __ATOMIC_ACQUIRE);
+	uint8_t *dst;
+
+	if (!p) return;
+	memset(&h, 0, sizeof(h));
+	clock_gettime(CLOCK_REALTIME, &ts);
+	h.id = id;
+	h.type = type;
+	h.xfer_type = 3; // bulk
+	h.epnum = ep;
+#if USE_LIBUSB
+	{
+		libusb_device *dev = libusb_get_device(io->dev_handle);
+		h.devnum = libusb_get_device_address(dev);
+		h.busnum = libusb_get_bus_number(dev);
+	}
+#else
+	(void)io;
+#endif
+	h.flag_setup = '-';
+	h.flag_data = data ? 0 : ep & 0x80 ? '<' : '>';
+	h.ts_sec = ts.tv_sec;
+	h.ts_usec = ts.tv_nsec / 1000;
+	h.status = type == 'S' ? -EINPROGRESS : status;
+	h.length = len;
+	if (cap > max) cap = max;
+	h.len_cap = cap;
+	rec[0] = h.ts_sec;
+	rec[1] = h.ts_usec;
+	rec[2] = sizeof(h) + cap;
+	rec[3] = sizeof(h) + (data ? len : 0);
+
+#if USE_LIBUSB
+	pthread_mutex_lock(&p->mutex);
+	// too late, the file is closed
+	if (p->stop) {
+		pthread_mutex_unlock(&p->mutex);
+		return;
+	}
+#endif
+	if (p->len[p->cur] + rec[2] + sizeof(rec) > PCAP_BUF_LEN) pcap_swap(p);
+	dst = p->buf[p->cur] + p->len[p->cur];
+	memcpy(dst, rec, sizeof(rec));
+	memcpy(dst + sizeof(rec), &h, sizeof(h));
+	if (cap) memcpy(dst + sizeof(rec) + sizeof(h), data, cap);
+	p->len[p->cur] += rec[2] + sizeof(rec);
+#if USE_LIBUSB
+	pthread_mutex_unlock(&p->mutex);
+#endif
+}
+
+// the USB threads may still run at exit, so the writer is never freed
+static void pcap_stop(void) {
+	pcap_writer_t *p = pcap;
+	if (!p) return;
+#if USE_LIBUSB
+	pthread_mutex_lock(&p->mutex);
+	__atomic_store_n(&pcap, NULL, __ATOMIC_RELAXED);
+	if (p->len[p->cur]) pcap_swap(p);
+	p->stop = 1;
+	pthread_cond_broadcast(&p->cond);
+	pthread_mutex_unlock(&p->mutex);
+	pthread_join(p->thread, NULL);
+#else
+	pcap = NULL;
+	pcap_swap(p);
+#endif
+	if (p->error) DBG_LOG("pcap: write failed\n");
+	close(p->fd);
+}
+
+// returns the ID for the completion record, or zero without --pcap
+static uint64_t pcap_submit(usbio_t *io, int ep, const void *data, uint32_t len) {
+	uint64_t id;
+	if (!pcap) return 0;
+	id = __atomic_add_fetch(&pcap_id, 1, __ATOMIC_RELAXED);
+	pcap_urb(io, id, 'S', ep, data, len, 0);
+	return id;
+}
+
+// the records are flushed at exit (also after an error)
+static void pcap_start(const char *fn) {
+	pcap_writer_t *p = (pcap_writer_t*)calloc(1, sizeof(pcap_writer_t));
+	uint32_t hdr[6] = { 0xa1b2c3d4, 2 | 4 << 16, 0, 0, PCAP_BUF_LEN, PCAP_LINKTYPE };
+	if (!p) ERR_EXIT("malloc failed\n");
+	p->fd = open(fn, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+	if (p->fd < 0) ERR_EXIT("open(\"%s\") failed\n", fn);
+	if (pcap_put(p->fd, (uint8_t*)hdr, sizeof(hdr)))
+		ERR_EXIT("write failed\n");
+	p->buf[0] = (uint8_t*)malloc(PCAP_BUF_LEN);
+#if USE_LIBUSB
+	p->buf[1] = (uint8_t*)malloc(PCAP_BUF_LEN);
+	if (!p->buf[1]) ERR_EXIT("malloc failed\n");
+	pthread_mutex_init(&p->mutex, NULL);
+	pthread_cond_init(&p->cond, NULL);
+	if (pthread_create(&p->thread, NULL, pcap_main, p))
+		ERR_EXIT("pthread_create failed\n");
+#endif
+	if (!p->buf[0]) ERR_EXIT("malloc failed\n");
+	pcap = p;
+	atexit(pcap_stop);
+}
+
+// returns the number of bytes sent or a negative error code
+static int usb_write(usbio_t *io, const uint8_t *buf, int len) {
+	int ret;
+	uint64_t id = pcap_submit(io, PCAP_EP_OUT(io), buf, len);
 	if (io->verbose >= 2) {
 		DBG_LOG("send (%d):\n", len);
-		print_mem(stderr, buf, len);
+		print_mem(LOG_FILE, buf, len);
 	}
-
 #if USE_LIBUSB
 	{
 		int err = libusb_bulk_transfer(io->dev_handle,
 				io->endp_out, (uint8_t*)buf, len, &ret, io->timeout);
-		if (err < 0)
-			ERR_EXIT("usb_send failed : %s\n", libusb_error_name(err));
+		if (err < 0) ret = err;
 	}
 #else
-	ret = write(io->serial, buf, len);
+	for (ret = 0; ret < len; ) {
+		int n = write(io->serial, buf + ret, len - ret);
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) {
+			if (!ret) ret = n;
+			break;
+		}
+		ret += n;
+	}
+	if (ret == len) tcdrain(io->serial);
+	// usleep(1000);
 #endif
-	if (ret != len)
-		ERR_EXIT("usb_send failed (%d / %d)\n", ret, len);
+	if (id) pcap_urb(io, id, 'C', PCAP_EP_OUT(io), NULL,
+			ret < 0 ? 0 : ret, ret < 0 ? -EIO : 0);
+	return ret;
+}
 
-#if !USE_LIBUSB
-	tcdrain(io->serial);
-	// usleep(1000);
+static int usb_send(usbio_t *io, const void *data, int len) {
+	const uint8_t *buf = (const uint8_t*)data;
+	int ret;
+
+	if (!buf) buf = io->buf;
+	if (!len) ERR_EXIT("empty message\n");
+	ret = usb_write(io, buf, len);
+#if USE_LIBUSB
+	if (ret < 0)
+		XFER_EXIT(ret == LIBUSB_ERROR_NO_DEVICE ? XFER_GONE : XFER_TIMEOUT,
+				"usb_send failed : %s\n", libusb_error_name(ret));
 #endif
+	if (ret != len)
+		XFER_EXIT(ret < 0 ? XFER_GONE : XFER_TIMEOUT,
+				"usb_send failed (%d / %d)\n", ret, len);
 	return ret;
 }
 
@@ -284,13 +699,17 @@ static int usb_recv(usbio_t *io, int plen) {
 	pos = io->recv_pos;
 	while (nread < plen) {
 		if (pos >= len) {
+			uint64_t id;
 #if USE_LIBUSB
-			int err = libusb_bulk_transfer(io->dev_handle, io->endp_in, io->recv_buf, RECV_BUF_LEN, &len, io->timeout);
+			int err;
+			id = pcap_submit(io, io->endp_in, NULL, RECV_BUF_LEN);
+			err = libusb_bulk_transfer(io->dev_handle, io->endp_in, io->recv_buf, RECV_BUF_LEN, &len, io->timeout);
+			if (id) pcap_urb(io, id, 'C', io->endp_in, io->recv_buf, len, err < 0 ? -EIO : 0);
 			if (err == LIBUSB_ERROR_NO_DEVICE)
-				ERR_EXIT("connection closed\n");
+				XFER_EXIT(XFER_GONE, "connection closed\n");
 			else if (err == LIBUSB_ERROR_TIMEOUT) break;
 			else if (err < 0)
-				ERR_EXIT("usb_recv failed : %s\n", libusb_error_name(err));
+				XFER_EXIT(XFER_TIMEOUT, "usb_recv failed : %s\n", libusb_error_name(err));
 #else
 			if (io->timeout >= 0) {
 				struct pollfd fds = { 0 };
@@ -299,17 +718,20 @@ static int usb_recv(usbio_t *io, int plen) {
 				a = poll(&fds, 1, io->timeout);
 				if (a < 0) ERR_EXIT("poll failed, ret = %d\n", a);
 				if (fds.revents & POLLHUP)
-					ERR_EXIT("connection closed\n");
+					XFER_EXIT(XFER_GONE, "connection closed\n");
 				if (!a) break;
 			}
+			id = pcap_submit(io, PCAP_EP_IN(io), NULL, RECV_BUF_LEN);
 			len = read(io->serial, io->recv_buf, RECV_BUF_LEN);
+			if (id) pcap_urb(io, id, 'C', PCAP_EP_IN(io), io->recv_buf,
+					len < 0 ? 0 : len, len < 0 ? -EIO : 0);
 #endif
 			if (len < 0)
-				ERR_EXIT("usb_recv failed, ret = %d\n", len);
+				XFER_EXIT(XFER_GONE, "usb_recv failed, ret = %d\n", len);
 
 			if (io->verbose >= 2) {
 				DBG_LOG("recv (%d):\n", len);
-				print_mem(stderr, io->recv_buf, len);
+				print_mem(LOG_FILE, io->recv_buf, len);
 			}
 			pos = 0;
 			if (!len) break;
@@ -323,21 +745,629 @@ static int usb_recv(usbio_t *io, int plen) {
 	return nread;
 }
 
-static uint8_t* loadfile(const char *fn, size_t *num) {
-	size_t n, j = 0; uint8_t *buf = 0;
-	FILE *fi = fopen(fn, "rb");
-	if (fi) {
-		fseek(fi, 0, SEEK_END);
-		n = ftell(fi);
-		if (n) {
-			fseek(fi, 0, SEEK_SET);
-			buf = (uint8_t*)malloc(n);
-			if (buf) j = fread(buf, 1, n, fi);
+// receives the data phase directly to the destination buffer
+static int usb_recv_buf(usbio_t *io, void *dst, int len) {
+	uint8_t *p = (uint8_t*)dst;
+	int n, nread = io->recv_len - io->recv_pos;
+
+	// the rest of the previous serial read
+	if (nread > len) nread = len;
+	if (nread > 0) {
+		memcpy(p, io->recv_buf + io->recv_pos, nread);
+		io->recv_pos += nread;
+	} else nread = 0;
+
+	while (nread < len) {
+		uint64_t id;
+#if USE_LIBUSB
+		int err;
+		id = pcap_submit(io, io->endp_in, NULL, len - nread);
+		err = libusb_bulk_transfer(io->dev_handle, io->endp_in, p + nread, len - nread, &n, io->timeout);
+		if (id) pcap_urb(io, id, 'C', io->endp_in, p + nread, n, err < 0 ? -EIO : 0);
+		if (err == LIBUSB_ERROR_NO_DEVICE)
+			XFER_EXIT(XFER_GONE, "connection closed\n");
+		else if (err == LIBUSB_ERROR_TIMEOUT) {
+			// the part received before the timeout is in the buffer
+			nread += n;
+			break;
+		} else if (err < 0)
+			XFER_EXIT(XFER_TIMEOUT, "usb_recv failed : %s\n", libusb_error_name(err));
+#else
+		if (io->timeout >= 0) {
+			struct pollfd fds = { 0 };
+			fds.fd = io->serial;
+			fds.events = POLLIN;
+			n = poll(&fds, 1, io->timeout);
+			if (n < 0) ERR_EXIT("poll failed, ret = %d\n", n);
+			if (fds.revents & POLLHUP)
+				XFER_EXIT(XFER_GONE, "connection closed\n");
+			if (!n) break;
+		}
+		id = pcap_submit(io, PCAP_EP_IN(io), NULL, len - nread);
+		n = read(io->serial, p + nread, len - nread);
+		if (id) pcap_urb(io, id, 'C', PCAP_EP_IN(io), p + nread,
+				n < 0 ? 0 : n, n < 0 ? -EIO : 0);
+#endif
+		if (n < 0)
+			XFER_EXIT(XFER_GONE, "usb_recv failed, ret = %d\n", n);
+
+		if (io->verbose >= 2) {
+			DBG_LOG("recv (%d):\n", n);
+			print_mem(LOG_FILE, p + nread, n);
+		}
+		if (!n) break;
+		nread += n;
+#if USE_LIBUSB
+		break; // short packet ends the data phase
+#endif
+	}
+	io->nread = nread;
+	return nread;
+}
+
+/*
+ * In daemon mode, "@N" is the Nth descriptor passed with the request.
+ */
+static __thread const int *daemon_fds;
+static __thread int daemon_nfds;
+
+// returns the index of the passed descriptor or -1
+static int fd_arg(const char *fn) {
+	char *end; long i;
+	if (!daemon_fds || fn[0] != '@') return -1;
+	i = strtol(fn + 1, &end, 10);
+	if (end == fn + 1 || *end || i < 0 || i >= daemon_nfds) return -1;
+	return i;
+}
+
+// the daemon doesn't open files by name for the clients
+static void check_arg(const char *fn) {
+	if (daemon_fds && fd_arg(fn) < 0)
+		ERR_EXIT("\"%s\" is not a passed descriptor\n", fn);
+}
+
+static FILE* fopen_arg(const char *fn, const char *mode) {
+	int fd, i = fd_arg(fn); FILE *f;
+	check_arg(fn);
+	if (i < 0) return fopen(fn, mode);
+	fd = dup(daemon_fds[i]);
+	if (fd < 0) return NULL;
+	// pipes can't be truncated
+	if (*mode == 'w' && ftruncate(fd, 0) && errno != EINVAL) {
+		close(fd);
+		return NULL;
+	}
+	f = fdopen(fd, mode);
+	if (!f) close(fd);
+	return f;
+}
+
+/*
+ * Input files are mapped, pipes are read by chunks ("-" is stdin),
+ * so the transfer starts without loading the whole file.
+ */
+
+#define INPUT_STREAM ((uint64_t)-1)
+
+typedef struct {
+	int fd; uint8_t *map, *buf;
+	size_t map_len, buf_len;
+	// the size is INPUT_STREAM for a pipe read to the end
+	uint64_t pos, size;
+} input_t;
+
+// zero size means until the end of the file
+static void input_open(input_t *in, const char *fn, uint64_t offs, uint64_t size) {
+	struct stat st;
+	int i = fd_arg(fn);
+
+	check_arg(fn);
+	in->fd = !strcmp(fn, "-") ? dup(0) : i >= 0 ?
+			dup(daemon_fds[i]) : open(fn, O_RDONLY | O_CLOEXEC);
+	if (in->fd < 0) ERR_EXIT("open(\"%s\") failed\n", fn);
+	in->map = in->buf = NULL;
+	in->map_len = in->buf_len = 0;
+	in->pos = 0;
+
+	if (!fstat(in->fd, &st) && S_ISREG(st.st_mode)) {
+		uint64_t n = st.st_size;
+		if (n < offs || (size && n - offs < size))
+			ERR_EXIT("data outside the file\n");
+		in->size = size ? size : n - offs;
+		if (!in->size) return;
+#ifndef _WIN32
+		in->map_len = offs + in->size;
+		in->map = (uint8_t*)mmap(NULL, in->map_len, PROT_READ, MAP_PRIVATE, in->fd, 0);
+		if (in->map != MAP_FAILED) {
+			madvise(in->map, in->map_len, MADV_SEQUENTIAL);
+			in->map += offs;
+			return;
+		}
+		in->map = NULL;
+#endif
+		if (lseek(in->fd, offs, SEEK_SET) < 0)
+			ERR_EXIT("lseek failed\n");
+		return;
+	}
+	in->size = size ? size : INPUT_STREAM;
+	// skip to the offset
+	while (offs) {
+		uint8_t buf[0x1000];
+		ssize_t k = read(in->fd, buf, offs < sizeof(buf) ? offs : sizeof(buf));
+		if (k <= 0) ERR_EXIT("data outside the file\n");
+		offs -= k;
+	}
+}
+
+// returns the next chunk of up to "max" bytes, the length is zero at the end
+static const uint8_t* input_read(input_t *in, size_t max, size_t *len) {
+	size_t n = 0;
+	ssize_t k;
+	if (in->size - in->pos < max) max = in->size - in->pos;
+	if (in->map) {
+		*len = max;
+		in->pos += max;
+		return in->map + in->pos - max;
+	}
+	if (in->buf_len < max) {
+		free(in->buf);
+		in->buf = (uint8_t*)malloc(max);
+		if (!in->buf) ERR_EXIT("malloc failed\n");
+		in->buf_len = max;
+	}
+	for (; n < max; n += k) {
+		k = read(in->fd, in->buf + n, max - n);
+		if (k < 0 && errno == EINTR) k = 0;
+		else if (k <= 0) break;
+	}
+	if (n < max && in->size != INPUT_STREAM)
+		ERR_EXIT("data outside the file\n");
+	*len = n;
+	in->pos += n;
+	return in->buf;
+}
+
+static void input_close(input_t *in) {
+#ifndef _WIN32
+	if (in->map) munmap(in->map - (in->map_len - in->size), in->map_len);
+#endif
+	free(in->buf);
+	close(in->fd);
+}
+
+// the output file name with the worker's prefix and the suffix
+static char* out_name(const char *fn, const char *suffix) {
+	const char *base, *prefix = out_prefix ? out_prefix : "";
+	char *name;
+	base = strrchr(fn, '/');
+	base = base ? base + 1 : fn;
+	name = (char*)malloc(strlen(fn) + strlen(prefix) + strlen(suffix) + 1);
+	if (!name) ERR_EXIT("malloc failed\n");
+	sprintf(name, "%.*s%s%s%s", (int)(base - fn), fn, prefix, base, suffix);
+	return name;
+}
+
+static FILE* fopen_out(const char *fn) {
+	char *name = out_name(fn, ""); FILE *f;
+	f = fopen_arg(name, "wb");
+	free(name);
+	return f;
+}
+
+static uint32_t crc32_update(uint32_t crc, const void *buf, size_t n) {
+	static const uint32_t tab[16] = {
+		0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac,
+		0x76dc4190, 0x6b6b51f4, 0x4db26158, 0x5005713c,
+		0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c,
+		0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c };
+	const uint8_t *p = (const uint8_t*)buf;
+	crc = ~crc;
+	while (n--) {
+		crc ^= *p++;
+		crc = crc >> 4 ^ tab[crc & 15];
+		crc = crc >> 4 ^ tab[crc & 15];
+	}
+	return ~crc;
+}
+
+/*
+ * Dumps write a journal next to the output: the description of the dump,
+ * then "offset size crc32" of each chunk written. With --resume, the dump
+ * continues after the last chunk that matches the file.
+ */
+
+static int dump_resume = 0;
+static int dump_direct = 0;
+// set when a command is run again after a transfer error
+static __thread int dump_retry;
+// the files of the running dump, to close them if it's interrupted
+static __thread FILE *dump_files[3];
+// and its buffers
+#define DUMP_ALLOCS 8
+static __thread void *dump_allocs[DUMP_ALLOCS];
+
+static void* dump_realloc(void *p, size_t n) {
+	int i;
+	for (i = 0; i < DUMP_ALLOCS; i++)
+		if (dump_allocs[i] == p) break;
+	if (i == DUMP_ALLOCS || !(p = realloc(p, n)))
+		ERR_EXIT("malloc failed\n");
+	return dump_allocs[i] = p;
+}
+
+#define dump_alloc(n) dump_realloc(NULL, n)
+
+static void dump_free(void *p) {
+	int i;
+	if (!p) return;
+	for (i = 0; i < DUMP_ALLOCS; i++)
+		if (dump_allocs[i] == p) dump_allocs[i] = NULL;
+	free(p);
+}
+
+typedef struct dump_writer dump_writer_t;
+
+typedef struct {
+	FILE *fo, *journal;
+	char *journal_fn;
+	uint64_t done;
+	dump_writer_t *writer;
+} dump_file_t;
+
+typedef struct { uint64_t pos; uint32_t len, crc; } journal_entry_t;
+
+static int journal_check(FILE *fo, const journal_entry_t *e) {
+	uint8_t buf[0x1000]; uint32_t n, crc = 0, len = e->len;
+	if (fseeko(fo, e->pos, SEEK_SET)) return 0;
+	for (; len; len -= n) {
+		n = len < sizeof(buf) ? len : sizeof(buf);
+		if (fread(buf, 1, n, fo) != n) return 0;
+		crc = crc32_update(crc, buf, n);
+	}
+	return crc == e->crc;
+}
+
+// returns the number of valid entries
+static unsigned journal_load(const char *journal_fn, FILE *fo,
+		const char *desc, journal_entry_t **list) {
+	char line[256];
+	journal_entry_t *tab = NULL, e;
+	unsigned n = 0, max = 0;
+	uint64_t pos = 0;
+	FILE *f = fopen(journal_fn, "r");
+
+	*list = NULL;
+	if (!f) return 0;
+	if (!fgets(line, sizeof(line), f) || strcmp(line, desc)) {
+		DBG_LOG("journal doesn't match the command\n");
+		fclose(f);
+		return 0;
+	}
+	while (fgets(line, sizeof(line), f)) {
+		unsigned long long a; unsigned b, c;
+		if (sscanf(line, "%llx %x %x", &a, &b, &c) != 3) break;
+		e.pos = a; e.len = b; e.crc = c;
+		if (e.pos != pos) break;
+		if (n == max) {
+			max = max ? max * 2 : 256;
+			tab = (journal_entry_t*)realloc(tab, max * sizeof(*tab));
+			if (!tab) ERR_EXIT("malloc failed\n");
+		}
+		tab[n++] = e;
+		pos += e.len;
+	}
+	fclose(f);
+	// the tail may not be written completely
+	while (n && !journal_check(fo, tab + n - 1)) n--;
+	*list = tab;
+	return n;
+}
+
+/*
+ * The chunks are stored by the writer, from a thread in the libusb build,
+ * which takes them from a few buffers, so a slow disk doesn't stall the
+ * transfers. With --direct, the chunks aligned by DIRECT_ALIGN are written
+ * with O_DIRECT. With --sparse, the blocks of HOLE_ALIGN bytes filled with
+ * the hole value are skipped, these are read as zeros.
+ */
+
+#define WRITER_BUFS 4
+#define DIRECT_ALIGN 4096
+#define HOLE_ALIGN 4096
+
+static int dump_sparse = -1;
+
+#ifdef _WIN32
+// only the writer thread uses the file position
+static ssize_t pwrite(int fd, const void *buf, size_t n, off_t pos) {
+	if (lseek(fd, pos, SEEK_SET) < 0) return -1;
+	return write(fd, buf, n);
+}
+#endif
+
+struct dump_writer {
+#if USE_LIBUSB
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	struct { uint8_t *buf; size_t len, size; } slot[WRITER_BUFS];
+	unsigned head, tail;
+	int stop;
+#endif
+	int error, fd, direct_fd, hole, stream;
+	uint64_t pos;
+	FILE *journal;
+};
+
+static __thread dump_writer_t *dump_writer;
+
+static int writer_pwrite(dump_writer_t *w,
+		const uint8_t *buf, size_t n, uint64_t pos) {
+	int fd = w->fd;
+	ssize_t k;
+	uint64_t time = trace_buf ? get_time_usec() : 0;
+	if (w->direct_fd >= 0 &&
+			!((pos | n | (uintptr_t)buf) & (DIRECT_ALIGN - 1)))
+		fd = w->direct_fd;
+	for (; n; n -= k, buf += k, pos += k) {
+		k = w->stream ? write(fd, buf, n) : pwrite(fd, buf, n, pos);
+		if (k <= 0) return -1;
+		fd = w->fd;
+		if (time) trace_span("write", time, get_time_usec(), pos, k);
+	}
+	return 0;
+}
+
+static int block_filled(const uint8_t *buf, size_t n, int a) {
+	size_t i;
+	for (i = 0; i < n; i++)
+		if (buf[i] != a) return 0;
+	return 1;
+}
+
+// writes the chunk and its journal entry, returns non-zero on error
+static int writer_put(dump_writer_t *w, const uint8_t *buf, size_t n) {
+	static const uint8_t zero[HOLE_ALIGN];
+	size_t i, k, start = 0;
+	uint32_t crc = 0;
+	int hole = 0;
+
+	for (i = 0; i < n; i += k) {
+		k = HOLE_ALIGN - ((w->pos + i) & (HOLE_ALIGN - 1));
+		if (k > n - i) k = n - i;
+		hole = w->hole >= 0 && k == HOLE_ALIGN &&
+				block_filled(buf + i, k, w->hole);
+		// the journal has the CRC of the data as it's read from the file
+		crc = crc32_update(crc, hole ? zero : buf + i, k);
+		if (!hole) continue;
+		if (writer_pwrite(w, buf + start, i - start, w->pos + start))
+			return -1;
+		start = i + k;
+	}
+	if (writer_pwrite(w, buf + start, n - start, w->pos + start))
+		return -1;
+	w->pos += n;
+	// a hole at the end of the file needs the file size
+	if (hole && ftruncate(w->fd, w->pos)) return -1;
+	// the data must be in the file before the journal entry
+	if (w->journal) {
+		fprintf(w->journal, "%llx %x %08x\n",
+				(long long)(w->pos - n), (unsigned)n, crc);
+		fflush(w->journal);
+	}
+	return 0;
+}
+
+#if USE_LIBUSB
+// an error on the writer thread fails the dump, not the process
+static int writer_put_guarded(dump_writer_t *w, const uint8_t *buf, size_t n) {
+	jmp_buf jmp; int err;
+	if (setjmp(jmp)) err = -1;
+	else {
+		err_jmp = &jmp;
+		err = writer_put(w, buf, n);
+	}
+	err_jmp = NULL;
+	return err;
+}
+
+static void* writer_main(void *arg) {
+	dump_writer_t *w = (dump_writer_t*)arg;
+	trace_thread("writer");
+	pthread_mutex_lock(&w->mutex);
+	for (;;) {
+		uint8_t *buf; size_t n; int err = w->error;
+		while (w->head == w->tail && !w->stop)
+			pthread_cond_wait(&w->cond, &w->mutex);
+		if (w->head == w->tail) break;
+		buf = w->slot[w->tail % WRITER_BUFS].buf;
+		n = w->slot[w->tail % WRITER_BUFS].len;
+		pthread_mutex_unlock(&w->mutex);
+		if (!err) err = writer_put_guarded(w, buf, n);
+		pthread_mutex_lock(&w->mutex);
+		w->error = err;
+		w->tail++;
+		pthread_cond_broadcast(&w->cond);
+	}
+	pthread_mutex_unlock(&w->mutex);
+	return NULL;
+}
+#endif
+
+static void writer_start(dump_file_t *d, const char *name, int hole) {
+	dump_writer_t *w = (dump_writer_t*)calloc(1, sizeof(dump_writer_t));
+	if (!w) ERR_EXIT("malloc failed\n");
+	w->fd = fileno(d->fo);
+	w->direct_fd = -1;
+	w->hole = hole;
+	// a pipe from the daemon client
+	if (lseek(w->fd, 0, SEEK_CUR) < 0) {
+		w->stream = 1;
+		w->hole = -1;
+	} else if (dump_direct && fd_arg(name) < 0) {
+#ifdef O_DIRECT
+		w->direct_fd = open(name, O_WRONLY | O_DIRECT | O_CLOEXEC);
+#endif
+		if (w->direct_fd < 0) DBG_LOG("O_DIRECT is not supported\n");
+	}
+	w->pos = d->done;
+	w->journal = d->journal;
+#if USE_LIBUSB
+	pthread_mutex_init(&w->mutex, NULL);
+	pthread_cond_init(&w->cond, NULL);
+	if (pthread_create(&w->thread, NULL, writer_main, w))
+		ERR_EXIT("pthread_create failed\n");
+#endif
+	d->writer = dump_writer = w;
+}
+
+// waits for the queued chunks, returns non-zero if a write failed
+static int writer_stop(dump_writer_t *w) {
+	int err;
+#if USE_LIBUSB
+	int i;
+	pthread_mutex_lock(&w->mutex);
+	w->stop = 1;
+	pthread_cond_broadcast(&w->cond);
+	pthread_mutex_unlock(&w->mutex);
+	pthread_join(w->thread, NULL);
+	for (i = 0; i < WRITER_BUFS; i++) free(w->slot[i].buf);
+	pthread_cond_destroy(&w->cond);
+	pthread_mutex_destroy(&w->mutex);
+#endif
+	err = w->error;
+	if (w->direct_fd >= 0) close(w->direct_fd);
+	free(w);
+	dump_writer = NULL;
+	return err;
+}
+
+/*
+ * Opens the output, "desc" is the first line of the journal (NULL for
+ * no journal). The final size is reserved if known. With "--sparse 0xff"
+ * the erased pages are holes if "erased" is set, the OOB file must tell
+ * them from the zero pages.
+ */
+static void dump_open(dump_file_t *d, const char *fn,
+		const char *desc, uint64_t size, int erased) {
+	char *name = out_name(fn, "");
+	journal_entry_t *list = NULL;
+	unsigned i, n = 0;
+
+	check_arg(name);
+	d->done = 0;
+	d->fo = d->journal = NULL;
+	d->journal_fn = NULL;
+	d->writer = NULL;
+	// no journal for a passed descriptor
+	if (fd_arg(name) >= 0) desc = NULL;
+	if (desc) {
+		d->journal_fn = out_name(fn, ".journal");
+		if ((dump_resume || dump_retry) && (d->fo = fopen(name, "r+b")))
+			n = journal_load(d->journal_fn, d->fo, desc, &list);
+	}
+	if (n) {
+		d->done = list[n - 1].pos + list[n - 1].len;
+		if (ftruncate(fileno(d->fo), d->done) || fseeko(d->fo, d->done, SEEK_SET))
+			ERR_EXIT("can't resume \"%s\"\n", name);
+		DBG_LOG("resume from 0x%llx\n", (long long)d->done);
+	} else {
+		if (d->fo) fclose(d->fo);
+		d->fo = fopen_arg(name, "wb");
+	}
+	if (!d->fo) ERR_EXIT("fopen(wb) failed\n");
+	dump_files[0] = d->fo;
+
+	if (desc) {
+		d->journal = fopen(d->journal_fn, "w");
+		if (!d->journal) ERR_EXIT("fopen(journal) failed\n");
+		dump_files[1] = d->journal;
+		fputs(desc, d->journal);
+		for (i = 0; i < n; i++)
+			fprintf(d->journal, "%llx %x %08x\n",
+					(long long)list[i].pos, list[i].len, list[i].crc);
+		fflush(d->journal);
+	}
+	free(list);
+
+	// the file size is not changed, it's the size of the written part
+#ifdef FALLOC_FL_KEEP_SIZE
+	if (size > d->done && dump_sparse < 0 && fallocate(fileno(d->fo),
+			FALLOC_FL_KEEP_SIZE, d->done, size - d->done) && errno != ESPIPE)
+		DBG_LOG("fallocate failed\n");
+#endif
+	writer_start(d, name, dump_sparse < 0 ? -1 : erased ? dump_sparse : 0);
+	free(name);
+}
+
+static void dump_write(dump_file_t *d, const void *buf, size_t n) {
+	dump_writer_t *w = d->writer;
+#if USE_LIBUSB
+	unsigned i; int err;
+	pthread_mutex_lock(&w->mutex);
+	while (w->head - w->tail >= WRITER_BUFS && !w->error)
+		pthread_cond_wait(&w->cond, &w->mutex);
+	i = w->head % WRITER_BUFS;
+	err = w->error;
+	pthread_mutex_unlock(&w->mutex);
+	if (err) ERR_EXIT("fwrite failed\n");
+	// the slot is not used by the writer until it's queued
+	if (w->slot[i].size < n) {
+		void *p;
+		free(w->slot[i].buf);
+		w->slot[i].buf = NULL;
+		w->slot[i].size = 0;
+#ifdef O_DIRECT
+		if (posix_memalign(&p, DIRECT_ALIGN, n)) p = NULL;
+#else
+		p = malloc(n);
+#endif
+		if (!p) ERR_EXIT("malloc failed\n");
+		w->slot[i].buf = (uint8_t*)p;
+		w->slot[i].size = n;
+	}
+	memcpy(w->slot[i].buf, buf, n);
+	w->slot[i].len = n;
+	pthread_mutex_lock(&w->mutex);
+	w->head++;
+	pthread_cond_broadcast(&w->cond);
+	pthread_mutex_unlock(&w->mutex);
+#else
+	if (writer_put(w, (const uint8_t*)buf, n))
+		ERR_EXIT("fwrite failed\n");
+#endif
+	d->done += n;
+}
+
+// the journal is removed when the dump is complete
+static void dump_close(dump_file_t *d, int complete) {
+	if (writer_stop(d->writer)) {
+		DBG_LOG("fwrite failed\n");
+		complete = 0;
+	}
+	d->writer = NULL;
+	fclose(d->fo);
+	if (d->journal) {
+		fclose(d->journal);
+		if (complete) remove(d->journal_fn);
+		free(d->journal_fn);
+	}
+	dump_files[0] = dump_files[1] = NULL;
+}
+
+// the written part stays valid, the journal is flushed after each chunk
+static void dump_abort(void) {
+	int i;
+	if (dump_writer) writer_stop(dump_writer);
+	for (i = 0; i < 3; i++)
+		if (dump_files[i]) {
+			fclose(dump_files[i]);
+			dump_files[i] = NULL;
 		}
-		fclose(fi);
+	for (i = 0; i < DUMP_ALLOCS; i++) {
+		free(dump_allocs[i]);
+		dump_allocs[i] = NULL;
 	}
-	if (num) *num = j;
-	return buf;
 }
 
 #define USBC_SIG 0x43425355
@@ -356,6 +1386,14 @@ enum {
 	CMD_ADFU_EXEC = 0x21,
 	CMD_ADFU_RETSIZE = 0x22, // addr = (uint8_t*)ret + 4
 	CMD_ADFU_READRET = 0x23, // addr = *(uint32_t*)ret
+	// adfus, bits 8-15 = flash read command (len = sectors),
+	// bits 16-23 = sectors for each CRC (0 = one CRC)
+	CMD_ADFU_CRC32 = 0xa4,
+	CMD_ADFU_READCOPY = 0xa5, // adfus, READRAM through the CPU
+	CMD_ADFU_SCRIPT = 0x26, // adfus, loads the script
+	CMD_ADFU_RUNSCRIPT = 0xa6, // len = output size
+	CMD_ADFU_JOB = 0x27, // adfus, EXEC from the main loop
+	CMD_ADFU_JOBSTATE = 0xa8, // 2 = running, 3 = done
 };
 
 typedef struct {
@@ -375,37 +1413,701 @@ typedef struct {
 	uint8_t	status;
 } usbs_cmd_t;
 
-static uint32_t scsi_tag = 1;
-static int adfu_chip = 0;
+/*
+ * --stats: the count, bytes and latencies of the CBW, data and CSW
+ * phases for each command (the 0x80 bit is set if the data is received),
+ * printed when the device is closed.
+ * Latencies are counted in log-linear histograms (like HDR histograms):
+ * 8 buckets for each power of two, so the error is within 1/8.
+ */
 
-static int check_usbs(usbio_t *io, void *ptr) {
-	usbs_cmd_t *usbs = (usbs_cmd_t*)(ptr ? ptr : io->buf);
-	do {
-		if (!ptr && usb_recv(io, USBS_LEN) != USBS_LEN) break;
-		if (READ32_LE(&usbs->sig) != USBS_SIG) break;
-		if (READ32_LE(&usbs->tag) != (int)scsi_tag++) break;
+#define STATS_SUB_BITS 3
+// up to 2^32 usec
+#define STATS_BUCKETS ((33 - STATS_SUB_BITS) << STATS_SUB_BITS)
+
+enum { PHASE_CBW, PHASE_DATA, PHASE_CSW, PHASE_TOTAL, PHASE_NUM };
+
+static const char *const phase_names[PHASE_NUM] = {
+	"cbw", "data", "csw", "total" };
+
+typedef struct {
+	uint64_t count, bytes, time;
+	uint32_t hist[PHASE_NUM][STATS_BUCKETS];
+} cmd_stats_t;
+
+struct usb_stats {
+	cmd_stats_t *cmd[256];
+	uint64_t first, last;
+};
+
+static int stats_enable = 0;
+static const char *stats_json = NULL;
+
+static usb_stats_t* usb_stats_new(void) {
+	usb_stats_t *s;
+	if (!stats_enable) return NULL;
+	s = (usb_stats_t*)calloc(1, sizeof(usb_stats_t));
+	if (!s) ERR_EXIT("malloc failed\n");
+	return s;
+}
+
+static unsigned stats_bucket(uint64_t v) {
+	unsigned e = 0;
+	if (v >> 32) v = 0xffffffff;
+	while (v >> (e + STATS_SUB_BITS + 1)) e++;
+	return (e << STATS_SUB_BITS) + (v >> e);
+}
+
+// the highest value of the bucket
+static uint64_t stats_value(unsigned i) {
+	unsigned e = i >> STATS_SUB_BITS;
+	if (e) e--;
+	return ((uint64_t)(i - (e << STATS_SUB_BITS)) << e) + (1 << e) - 1;
+}
+
+static uint64_t stats_percentile(const uint32_t *hist, uint64_t count, unsigned p) {
+	uint64_t n = 0, k = (count * p + 99) / 100;
+	unsigned i;
+	for (i = 0; i < STATS_BUCKETS; i++)
+		if ((n += hist[i]) >= k) break;
+	return stats_value(i);
+}
+
+// t = start, CBW sent, data phase done, status received
+/*
+ * The CBW and data callbacks may come in any order, and a status can be
+ * read long after the command was sent, so a phase can look negative.
+ */
+static uint64_t stats_delta(uint64_t start, uint64_t end) {
+	return end > start ? end - start : 0;
+}
+
+static void stats_add(usb_stats_t *s, int key, uint32_t bytes, const uint64_t *t) {
+	cmd_stats_t *c = s->cmd[key];
+	int i;
+	if (!c && !(c = s->cmd[key] = (cmd_stats_t*)calloc(1, sizeof(cmd_stats_t))))
+		return;
+	if (!s->first) s->first = t[0];
+	if (t[3] > s->last) s->last = t[3];
+	c->count++;
+	c->bytes += bytes;
+	c->time += stats_delta(t[0], t[3]);
+	for (i = 0; i < PHASE_TOTAL; i++)
+		c->hist[i][stats_bucket(stats_delta(t[i], t[i + 1]))]++;
+	c->hist[PHASE_TOTAL][stats_bucket(stats_delta(t[0], t[3]))]++;
+}
+
+static const char* stats_name(int key) {
+	switch (key) {
+	case CMD_ADFU_FLASH: return "FLASH";
+	case CMD_ADFU_FLASH | 0x80: return "READFLASH";
+	case CMD_ADFU_FLASH32: return "FLASH32";
+	case CMD_ADFU_FLASH32 | 0x80: return "READFLASH32";
+	case CMD_ADFU_WRITERAM: return "WRITERAM";
+	case CMD_ADFU_READRAM: return "READRAM";
+	case CMD_ADFU_SWITCH: return "SWITCH";
+	case CMD_ADFU_EXEC: return "EXEC";
+	case CMD_ADFU_RETSIZE | 0x80: return "RETSIZE";
+	case CMD_ADFU_READRET | 0x80: return "READRET";
+	case CMD_ADFU_CRC32: return "CRC32";
+	case CMD_ADFU_READCOPY: return "READCOPY";
+	case CMD_ADFU_SCRIPT: return "SCRIPT";
+	case CMD_ADFU_RUNSCRIPT: return "RUNSCRIPT";
+	case CMD_ADFU_JOB: return "JOB";
+	case CMD_ADFU_JOBSTATE: return "JOBSTATE";
+	}
+	return "";
+}
+
+static double stats_mbps(uint64_t bytes, uint64_t usec) {
+	return usec ? (double)bytes / usec : 0;
+}
+
+static void stats_print(usb_stats_t *s) {
+	uint64_t bytes = 0;
+	int key, i;
+
+	for (key = 0; key < 256; key++)
+		if (s->cmd[key]) bytes += s->cmd[key]->bytes;
+	DBG_LOG("stats: %.3fs, %llu bytes, %.2f MB/s\n",
+			(s->last - s->first) / 1e6, (long long)bytes,
+			stats_mbps(bytes, s->last - s->first));
+	DBG_LOG("%-12s %8s %12s %7s", "cmd", "count", "bytes", "MB/s");
+	for (i = 0; i < PHASE_NUM; i++)
+		DBG_LOG(" %13s", phase_names[i]);
+	DBG_LOG("\n%-12s %8s %12s %7s", "", "", "", "");
+	for (i = 0; i < PHASE_NUM; i++)
+		DBG_LOG(" %13s", "p50/p99 us");
+	DBG_LOG("\n");
+	for (key = 0; key < 256; key++) {
+		cmd_stats_t *c = s->cmd[key];
+		char buf[32];
+		if (!c) continue;
+		sprintf(buf, "%02x %s", key, stats_name(key));
+		DBG_LOG("%-12s %8llu %12llu %7.2f", buf, (long long)c->count,
+				(long long)c->bytes, stats_mbps(c->bytes, c->time));
+		for (i = 0; i < PHASE_NUM; i++) {
+			sprintf(buf, "%llu/%llu",
+					(long long)stats_percentile(c->hist[i], c->count, 50),
+					(long long)stats_percentile(c->hist[i], c->count, 99));
+			DBG_LOG(" %13s", buf);
+		}
+		DBG_LOG("\n");
+	}
+}
+
+// the histograms are written as [value, count] pairs of non-empty buckets
+static void stats_write_json(usb_stats_t *s, const char *fn) {
+	FILE *f = fopen_out(fn);
+	int key, i, j, n = 0;
+
+	if (!f) {
+		DBG_LOG("fopen_out(\"%s\") failed\n", fn);
+		return;
+	}
+	fprintf(f, "{\"time_us\": %llu, \"commands\": [",
+			(long long)(s->last - s->first));
+	for (key = 0; key < 256; key++) {
+		cmd_stats_t *c = s->cmd[key];
+		if (!c) continue;
+		fprintf(f, "%s\n {\"cmd\": %d, \"name\": \"%s\", \"count\": %llu, "
+				"\"bytes\": %llu, \"time_us\": %llu",
+				n++ ? "," : "", key, stats_name(key), (long long)c->count,
+				(long long)c->bytes, (long long)c->time);
+		for (i = 0; i < PHASE_NUM; i++) {
+			const char *sep = "";
+			fprintf(f, ",\n  \"%s\": {\"p50\": %llu, \"p99\": %llu, \"hist\": [",
+					phase_names[i],
+					(long long)stats_percentile(c->hist[i], c->count, 50),
+					(long long)stats_percentile(c->hist[i], c->count, 99));
+			for (j = 0; j < STATS_BUCKETS; j++) {
+				if (!c->hist[i][j]) continue;
+				fprintf(f, "%s[%llu, %u]", sep,
+						(long long)stats_value(j), c->hist[i][j]);
+				sep = ", ";
+			}
+			fprintf(f, "]}");
+		}
+		fprintf(f, "}");
+	}
+	fprintf(f, "\n]}\n");
+	fclose(f);
+}
+
+static void usb_stats_free(usbio_t *io) {
+	usb_stats_t *s = io->stats;
+	int i;
+	if (!s) return;
+	stats_print(s);
+	if (stats_json) stats_write_json(s, stats_json);
+	for (i = 0; i < 256; i++) free(s->cmd[i]);
+	free(s);
+	io->stats = NULL;
+}
+
+// the command and its phases for --stats and --trace, "t" as in stats_add
+static void usb_timed(usbio_t *io, int key, uint32_t len, const uint64_t *t) {
+	if (io->stats) stats_add(io->stats, key, len, t);
+	if (trace_buf) {
+		const char *name = stats_name(key);
+		trace_span(*name ? name : "cmd", t[0], t[3], key, len);
+		trace_span("cbw", t[0], t[1], key, 0);
+		if (t[2] > t[1]) trace_span("data", t[1], t[2], key, len);
+		trace_span("csw", t[2], t[3], key, 0);
+	}
+}
+
+/*
+ * Counts the synchronous command when its status is received,
+ * "data_end" is zero if the next command is sent without the status.
+ */
+static void usb_sync_end(usbio_t *io, uint64_t data_end) {
+	uint64_t t[4];
+	if (io->sync_key < 0) return;
+	t[0] = io->sync_time[0];
+	t[1] = io->sync_time[1];
+	t[2] = data_end ? data_end : t[1];
+	t[3] = data_end ? get_time_usec() : t[1];
+	usb_timed(io, io->sync_key, io->sync_len, t);
+	io->sync_key = -1;
+}
+
+static int check_usbs(usbio_t *io, void *ptr) {
+	usbs_cmd_t *usbs = (usbs_cmd_t*)(ptr ? ptr : io->buf);
+	uint64_t data_end = USB_TIMED(io) && !ptr ? get_time_usec() : 0;
+	do {
+		if (!ptr && usb_recv(io, USBS_LEN) != USBS_LEN) {
+			// no answer, the transfer can be retried
+			if (xfer_jmp) XFER_EXIT(XFER_TIMEOUT, "no status\n");
+			break;
+		}
+		if (READ32_LE(&usbs->sig) != USBS_SIG) break;
+		if (READ32_LE(&usbs->tag) != (int)io->scsi_tag++) break;
+		if (data_end) usb_sync_end(io, data_end);
 		return 0;
 	} while (0);
 	DBG_LOG("unexpected status\n");
 	return 1;
 }
 
+static void actions_cbw(void *ptr, int cmd,
+		uint32_t len, uint32_t addr, int recv, int data_len) {
+	usbc_cmd_t *usbc = (usbc_cmd_t*)ptr;
+	WRITE32_LE(&usbc->sig, USBC_SIG);
+	WRITE32_LE(&usbc->tag, 0);
+	WRITE32_LE(&usbc->data_len, data_len);
+	usbc->flags = recv << 7;
+	usbc->lun = 0;
+	usbc->cdb_len = 16;
+	memset(usbc->cdb, 0, 16);
+	usbc->cdb[0] = 0xcd;
+	WRITE32_LE(usbc->cdb + 1, cmd);
+	WRITE32_LE(usbc->cdb + 5, len);
+	WRITE32_LE(usbc->cdb + 9, addr);
+}
+
 static void actions_cmd(usbio_t *io, int cmd,
 		uint32_t len, uint32_t addr, int recv, int data_len) {
 	usbc_cmd_t usbc;
-	scsi_tag = 0; // important
-	WRITE32_LE(&usbc.sig, USBC_SIG);
-	WRITE32_LE(&usbc.tag, scsi_tag);
-	WRITE32_LE(&usbc.data_len, data_len);
-	usbc.flags = recv << 7;
-	usbc.lun = 0;
-	usbc.cdb_len = 16;
-	memset(usbc.cdb, 0, 16);
-	usbc.cdb[0] = 0xcd;
-	WRITE32_LE(usbc.cdb + 1, cmd);
-	WRITE32_LE(usbc.cdb + 5, len);
-	WRITE32_LE(usbc.cdb + 9, addr);
+	int timed = USB_TIMED(io);
+	io->scsi_tag = 0; // important
+	actions_cbw(&usbc, cmd, len, addr, recv, data_len);
+	if (timed) {
+		usb_sync_end(io, 0);
+		io->sync_time[0] = get_time_usec();
+	}
 	usb_send(io, &usbc, USBC_LEN);
+	if (timed) {
+		io->sync_time[1] = get_time_usec();
+		io->sync_key = (cmd | recv << 7) & 0xff;
+		io->sync_len = data_len;
+	}
+}
+
+/*
+ * Command queue: CBW, data phase and CSW of each command are submitted
+ * together, and the next queued command is started from the completion
+ * callback of the previous one, so the bus doesn't wait for the caller.
+ * The serial build executes commands synchronously with the same API.
+ * Results must be waited for in the order the commands were queued.
+ */
+
+#define ASYNC_QUEUE 16
+
+enum { ASYNC_OK, ASYNC_STATUS, ASYNC_LENGTH };
+
+typedef struct {
+	uint8_t cbw[USBC_LEN], csw[USBS_LEN];
+	uint8_t *data; uint32_t data_len;
+	int cmd, recv, status;
+	// CBW, data and CSW transfers completed (--stats, --trace)
+	uint64_t start, end[3];
+} async_cmd_t;
+
+/*
+ * The timeout of a queued command is 10 times its usual time (the average
+ * per ADFU command and power of two of the data length) plus 100ms, but
+ * no more than the "timeout" setting. The time of the commands that run
+ * code or scan a range doesn't depend on the data length, these always
+ * get the full timeout.
+ */
+#define ASYNC_TIME_MIN 8
+// up to 16M of data
+#define ASYNC_LEN_BITS 26
+
+// returns the time slot of the command, or -1 if it's not adapted
+static int async_time_slot(const async_cmd_t *c) {
+	int n = 0;
+	switch (c->cmd) {
+	case CMD_ADFU_EXEC: case CMD_ADFU_RUNSCRIPT: case CMD_ADFU_CRC32:
+		return -1;
+	}
+	while (n < ASYNC_LEN_BITS - 1 && c->data_len >> n) n++;
+	return c->cmd * ASYNC_LEN_BITS + n;
+}
+
+struct usb_async {
+	async_cmd_t queue[ASYNC_QUEUE];
+	unsigned head, done;
+	int error;
+	// usec, the average of the last ~8 commands
+	unsigned time_avg[256 * ASYNC_LEN_BITS];
+	uint8_t time_cnt[256 * ASYNC_LEN_BITS];
+#if USE_LIBUSB
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	struct libusb_transfer *xfer[3]; // CBW, data, CSW
+	// "failed" after an error on the event thread
+	int busy, pending, stop, failed;
+#endif
+};
+
+static void usb_timed_async(usbio_t *io, async_cmd_t *c) {
+	uint64_t t[4];
+	t[0] = c->start;
+	t[1] = c->end[0];
+	t[2] = c->data_len ? c->end[1] : t[1];
+	t[3] = c->end[2];
+	usb_timed(io, (c->cmd | c->recv << 7) & 0xff, c->data_len, t);
+}
+
+#if USE_LIBUSB
+static void usb_async_start(usbio_t *io);
+
+// the URB status for --pcap
+static int pcap_status(int status) {
+	switch (status) {
+	case LIBUSB_TRANSFER_COMPLETED: return 0;
+	case LIBUSB_TRANSFER_TIMED_OUT:
+	case LIBUSB_TRANSFER_CANCELLED: return -ENOENT;
+	case LIBUSB_TRANSFER_STALL: return -EPIPE;
+	case LIBUSB_TRANSFER_NO_DEVICE: return -ENODEV;
+	case LIBUSB_TRANSFER_OVERFLOW: return -EOVERFLOW;
+	}
+	return -EPROTO;
+}
+
+static void usb_async_finish(usbio_t *io) {
+	usb_async_t *as = io->async;
+	async_cmd_t *c = &as->queue[as->done++ % ASYNC_QUEUE];
+	int k;
+	as->busy = 0;
+	if (!c->status && USB_TIMED(io)) usb_timed_async(io, c);
+	if (!c->status && (k = async_time_slot(c)) >= 0) {
+		unsigned t = get_time_usec() - c->start, *avg = &as->time_avg[k];
+		if (as->time_cnt[k] < ASYNC_TIME_MIN)
+			as->time_cnt[k]++;
+		*avg = as->time_cnt[k] > 1 ? *avg - (*avg >> 3) + (t >> 3) : t;
+	}
+	if (c->status) {
+		as->error = c->status;
+		// the device state is unknown, drop the rest
+		while (as->done != as->head)
+			as->queue[as->done++ % ASYNC_QUEUE].status = c->status;
+	} else if (as->done != as->head)
+		usb_async_start(io);
+	pthread_cond_broadcast(&as->cond);
+}
+
+/*
+ * After an error on the event thread the transfers are in an unknown
+ * state, all commands fail until the device is reopened.
+ */
+static void usb_async_fail(usb_async_t *as) {
+	int i;
+	as->failed = 1;
+	as->error = -LIBUSB_TRANSFER_ERROR;
+	while (as->done != as->head)
+		as->queue[as->done++ % ASYNC_QUEUE].status = as->error;
+	as->busy = 0;
+	for (i = 0; i < 3; i++) libusb_cancel_transfer(as->xfer[i]);
+	pthread_cond_broadcast(&as->cond);
+}
+
+static void usb_async_done(usbio_t *io, struct libusb_transfer *t) {
+	usb_async_t *as = io->async;
+	async_cmd_t *c = &as->queue[as->done % ASYNC_QUEUE];
+	int i;
+
+	if (pcap) pcap_urb(io, (uintptr_t)t, 'C', t->endpoint,
+			t->endpoint & 0x80 ? t->buffer : NULL, t->actual_length,
+			pcap_status(t->status));
+	if (USB_TIMED(io))
+		for (i = 0; i < 3; i++)
+			if (as->xfer[i] == t) c->end[i] = get_time_usec();
+	if (!c->status) {
+		if (t->status != LIBUSB_TRANSFER_COMPLETED)
+			c->status = -t->status;
+		else if (t->actual_length != t->length)
+			c->status = ASYNC_LENGTH;
+		if (c->status)
+			for (i = 0; i < 3; i++)
+				if (as->xfer[i] != t) libusb_cancel_transfer(as->xfer[i]);
+	}
+	if (!--as->pending) {
+		if (!c->status) {
+			usbs_cmd_t *usbs = (usbs_cmd_t*)c->csw;
+			if (READ32_LE(&usbs->sig) != USBS_SIG ||
+					READ32_LE(&usbs->tag) != 0)
+				c->status = ASYNC_STATUS;
+		}
+		usb_async_finish(io);
+	}
+}
+
+static void LIBUSB_CALL usb_async_cb(struct libusb_transfer *t) {
+	usbio_t *io = (usbio_t*)t->user_data;
+	usb_async_t *as = io->async;
+	jmp_buf jmp;
+
+	pthread_mutex_lock(&as->mutex);
+	// the error goes to the worker waiting for the command
+	if (setjmp(jmp)) usb_async_fail(as);
+	else if (!as->failed) {
+		err_jmp = &jmp;
+		usb_async_done(io, t);
+	}
+	err_jmp = NULL;
+	pthread_mutex_unlock(&as->mutex);
+}
+
+static void usb_async_start(usbio_t *io) {
+	usb_async_t *as = io->async;
+	async_cmd_t *c = &as->queue[as->done % ASYNC_QUEUE];
+	struct libusb_transfer **x = as->xfer;
+	int i, err, k = async_time_slot(c);
+	unsigned timeout = io->timeout, t;
+
+	if (timeout && k >= 0 && as->time_cnt[k] >= ASYNC_TIME_MIN) {
+		t = as->time_avg[k] / 100 + 100;
+		if (t < timeout) timeout = t;
+	}
+	c->start = get_time_usec();
+	libusb_fill_bulk_transfer(x[0], io->dev_handle, io->endp_out,
+			c->cbw, USBC_LEN, usb_async_cb, io, timeout);
+	libusb_fill_bulk_transfer(x[1], io->dev_handle,
+			c->recv ? io->endp_in : io->endp_out,
+			c->data, c->data_len, usb_async_cb, io, timeout);
+	libusb_fill_bulk_transfer(x[2], io->dev_handle, io->endp_in,
+			c->csw, USBS_LEN, usb_async_cb, io, timeout);
+
+	as->busy = 1;
+	as->pending = 0;
+	for (i = 0; i < 3; i++) {
+		if (i == 1 && !c->data_len) continue;
+		if (pcap) pcap_urb(io, (uintptr_t)x[i], 'S', x[i]->endpoint,
+				x[i]->endpoint & 0x80 ? NULL : x[i]->buffer, x[i]->length, 0);
+		err = libusb_submit_transfer(x[i]);
+		if (err < 0) {
+			DBG_LOG("libusb_submit_transfer failed : %s\n", libusb_error_name(err));
+			c->status = err == LIBUSB_ERROR_NO_DEVICE ?
+					-LIBUSB_TRANSFER_NO_DEVICE : -LIBUSB_TRANSFER_ERROR;
+			while (i--) libusb_cancel_transfer(x[i]);
+			break;
+		}
+		as->pending++;
+	}
+	if (!as->pending) usb_async_finish(io);
+}
+
+static void* usb_event_thread(void *arg) {
+	usb_async_t *as = (usb_async_t*)arg;
+	trace_thread("usb events");
+	while (!as->stop) {
+		struct timeval tv = { 0, 100000 };
+		libusb_handle_events_timeout_completed(NULL, &tv, &as->stop);
+	}
+	return NULL;
+}
+#endif
+
+static void usb_async_init(usbio_t *io) {
+	usb_async_t *as = (usb_async_t*)calloc(1, sizeof(usb_async_t));
+	if (!as) ERR_EXIT("malloc failed\n");
+	io->async = as;
+#if USE_LIBUSB
+	{
+		int i;
+		for (i = 0; i < 3; i++)
+			if (!(as->xfer[i] = libusb_alloc_transfer(0)))
+				ERR_EXIT("libusb_alloc_transfer failed\n");
+	}
+	pthread_mutex_init(&as->mutex, NULL);
+	pthread_cond_init(&as->cond, NULL);
+	if (pthread_create(&as->thread, NULL, usb_event_thread, as))
+		ERR_EXIT("pthread_create failed\n");
+#endif
+}
+
+static void usb_async_free(usbio_t *io) {
+	usb_async_t *as = io->async;
+	if (!as) return;
+#if USE_LIBUSB
+	{
+		int i;
+		pthread_mutex_lock(&as->mutex);
+		while (as->busy) pthread_cond_wait(&as->cond, &as->mutex);
+		as->stop = 1;
+		pthread_mutex_unlock(&as->mutex);
+		pthread_join(as->thread, NULL);
+		// the cancelled transfers of a failed queue may be still pending
+		if (!as->failed)
+			for (i = 0; i < 3; i++) libusb_free_transfer(as->xfer[i]);
+		pthread_cond_destroy(&as->cond);
+		pthread_mutex_destroy(&as->mutex);
+	}
+#endif
+	free(as);
+	io->async = NULL;
+}
+
+static unsigned usb_async_cmd(usbio_t *io, int cmd, uint32_t len,
+		uint32_t addr, int recv, void *data, uint32_t data_len) {
+	usb_async_t *as; async_cmd_t *c; unsigned seq;
+
+	if (!io->async) usb_async_init(io);
+	as = io->async;
+#if USE_LIBUSB
+	pthread_mutex_lock(&as->mutex);
+	while (as->head - as->done >= ASYNC_QUEUE)
+		pthread_cond_wait(&as->cond, &as->mutex);
+#endif
+	seq = as->head++;
+	c = &as->queue[seq % ASYNC_QUEUE];
+	actions_cbw(c->cbw, cmd, len, addr, recv, data_len);
+	c->data = (uint8_t*)data;
+	c->data_len = data_len;
+	c->cmd = cmd & 0xff;
+	c->recv = recv;
+	c->status = as->error ? ASYNC_STATUS : ASYNC_OK;
+#if USE_LIBUSB
+	if (as->failed) c->status = -LIBUSB_TRANSFER_ERROR;
+	if (io->verbose >= 2) {
+		DBG_LOG("queue (%d):\n", USBC_LEN);
+		print_mem(LOG_FILE, c->cbw, USBC_LEN);
+		if (data_len && !recv) {
+			DBG_LOG("send (%d):\n", data_len);
+			print_mem(LOG_FILE, c->data, data_len);
+		}
+	}
+	if (c->status) as->done++;
+	else if (!as->busy) usb_async_start(io);
+	pthread_mutex_unlock(&as->mutex);
+#else
+	if (!c->status) {
+		c->start = get_time_usec();
+		usb_send(io, c->cbw, USBC_LEN);
+		if (USB_TIMED(io)) c->end[0] = get_time_usec();
+		if (data_len) {
+			if (!recv) usb_send(io, data, data_len);
+			else if (usb_recv_buf(io, data, data_len) != (int)data_len)
+				c->status = ASYNC_LENGTH;
+		}
+		if (USB_TIMED(io)) c->end[1] = get_time_usec();
+		io->scsi_tag = 0;
+		if (!c->status && check_usbs(io, NULL))
+			c->status = ASYNC_STATUS;
+		as->error = c->status;
+		if (!c->status && USB_TIMED(io)) {
+			c->end[2] = get_time_usec();
+			usb_timed_async(io, c);
+		}
+	}
+	as->done++;
+#endif
+	return seq;
+}
+
+static int usb_async_wait(usbio_t *io, unsigned seq) {
+	usb_async_t *as = io->async;
+	async_cmd_t *c = &as->queue[seq % ASYNC_QUEUE];
+	int status;
+#if USE_LIBUSB
+	pthread_mutex_lock(&as->mutex);
+	while ((int)(as->done - seq) <= 0)
+		pthread_cond_wait(&as->cond, &as->mutex);
+	status = c->status;
+	pthread_mutex_unlock(&as->mutex);
+	if (status == -LIBUSB_TRANSFER_NO_DEVICE)
+		XFER_EXIT(XFER_GONE, "connection closed\n");
+	if (status < 0)
+		XFER_EXIT(XFER_TIMEOUT, "usb transfer failed (status %d)\n", -status);
+	if (!status && c->recv && c->data_len && io->verbose >= 2) {
+		DBG_LOG("recv (%d):\n", c->data_len);
+		print_mem(LOG_FILE, c->data, c->data_len);
+	}
+#else
+	status = c->status;
+#endif
+	if (status == ASYNC_LENGTH)
+		XFER_EXIT(XFER_TIMEOUT, "unexpected length\n");
+	return status;
+}
+
+// wait for all queued commands and clear the error state
+static void usb_async_flush(usbio_t *io) {
+	usb_async_t *as = io->async;
+	if (!as) return;
+	if (as->head != as->done) usb_async_wait(io, as->head - 1);
+#if USE_LIBUSB
+	if (as->error == ASYNC_STATUS) DBG_LOG("unexpected status\n");
+#endif
+	as->error = 0;
+}
+
+static int write_verify = 0, write_diff = 0;
+#define VERIFY_LEN 0x10000
+// the size of the CRC list in adfus
+#define CRC_MAX 64
+// CRCs requested at once by write_flash --diff, up to CRC_MAX
+#define DIFF_BATCH 8
+
+/*
+ * Reads the CRC32 computed by adfus for each "step" sectors of the range,
+ * type is the flash read command (len in sectors) or 0 (len in bytes).
+ */
+static void adfu_crc32(usbio_t *io, int type,
+		uint32_t addr, uint32_t len, unsigned step, uint32_t *crc) {
+	uint8_t buf[CRC_MAX * 4];
+	unsigned i, n = 1;
+
+	if (step) n = ((type ? len : (len + 0x1ff) >> 9) + step - 1) / step;
+	if (n > CRC_MAX) ERR_EXIT("too many CRCs\n");
+	actions_cmd(io, CMD_ADFU_CRC32 | type << 8 | step << 16, len, addr, 1, n * 4);
+	if (usb_recv_buf(io, buf, n * 4) != (int)n * 4 || check_usbs(io, NULL) ||
+			((usbs_cmd_t*)io->buf)->status)
+		ERR_EXIT("CRC32 command failed\n");
+	for (i = 0; i < n; i++) crc[i] = READ32_LE(buf + i * 4);
+}
+
+// compares the CRC32 of the data written with the one computed by adfus
+static void adfu_verify(usbio_t *io, int type,
+		uint32_t addr, uint32_t len, uint32_t crc) {
+	uint32_t crc2;
+
+	adfu_crc32(io, type, addr, len, 0, &crc2);
+	if (crc != crc2)
+		ERR_EXIT("verify: mismatch at 0x%x (size 0x%x, crc 0x%08x, expected 0x%08x)\n",
+				addr, len, crc2, crc);
+}
+
+/*
+ * A job runs the code like EXEC, but from the adfus main loop,
+ * so the USB commands are served until it's done.
+ */
+#define JOB_POLL 1000 // usec
+
+// fails if the previous job (or a switch) hasn't finished
+static int adfu_job_start(usbio_t *io, uint32_t addr) {
+	usb_async_flush(io);
+	actions_cmd(io, CMD_ADFU_JOB, 0, addr, 0, 0);
+	if (check_usbs(io, NULL)) return -1;
+	if (((usbs_cmd_t*)io->buf)->status) {
+		DBG_LOG("job not started\n");
+		return -1;
+	}
+	return 0;
+}
+
+// waits for the job, then reads the result size if "ret" isn't NULL
+static int adfu_job_wait(usbio_t *io, uint8_t *ret) {
+	uint8_t buf[4];
+	uint64_t time = trace_buf ? get_time_usec() : 0;
+	for (;;) {
+		if (usb_async_wait(io, usb_async_cmd(io,
+				CMD_ADFU_JOBSTATE, 4, 0, 1, buf, 4))) return -1;
+		if (READ32_LE(buf) == 3) break;
+		if (READ32_LE(buf) != 2) {
+			DBG_LOG("no job started\n");
+			return -1;
+		}
+		usleep(JOB_POLL);
+	}
+	if (time) trace_span("job wait", time, get_time_usec(), 0, 0);
+	if (!ret) return 0;
+	return usb_async_wait(io, usb_async_cmd(io,
+			CMD_ADFU_RETSIZE, 4, 0, 1, ret, 4));
 }
 
 static void write_mem_buf(usbio_t *io,
@@ -425,239 +2127,433 @@ static void write_mem_buf(usbio_t *io,
 static void write_mem(usbio_t *io,
 		uint32_t addr, unsigned src_offs, unsigned src_size,
 		const char *fn, unsigned step) {
-	uint8_t *mem; size_t size = 0;
-	mem = loadfile(fn, &size);
-	if (!mem) ERR_EXIT("loadfile(\"%s\") failed\n", fn);
-	if (size >> 32) ERR_EXIT("file too big\n");
-	if (size < src_offs)
-		ERR_EXIT("data outside the file\n");
-	size -= src_offs;
-	if (src_size) {
-		if (size < src_size)
-			ERR_EXIT("data outside the file\n");
-		size = src_size;
+	input_t in; const uint8_t *mem;
+	size_t n; uint64_t i = 0, done = 0;
+	// the boot ROM can't compute CRC
+	int verify = write_verify && io->switched;
+	uint32_t crc = 0;
+
+	input_open(&in, fn, src_offs, src_size);
+	if (in.size != INPUT_STREAM && in.size >> 32)
+		ERR_EXIT("file too big\n");
+	for (;;) {
+		mem = input_read(&in, step, &n);
+		if (n) {
+			if ((i + n) >> 32) ERR_EXIT("file too big\n");
+			write_mem_buf(io, addr + i, n, mem, step);
+			if (verify) crc = crc32_update(crc, mem, n);
+			i += n;
+		}
+		if (verify && i > done && (!n || i - done >= VERIFY_LEN)) {
+			adfu_verify(io, 0, addr + done, i - done, crc);
+			done = i; crc = 0;
+		}
+		if (!n) break;
 	}
-	write_mem_buf(io, addr, size, mem + src_offs, step);
-	free(mem);
+	input_close(&in);
 }
 
-static unsigned dump_mem2(usbio_t *io,
-		uint32_t addr, uint32_t size, const char *fn, unsigned step) {
-	unsigned i, n, n2;
-
-	const uint32_t code_addr_mips = 0xbfc1e000 + 1;
-	const uint32_t buf_addr_mips = 0xbfc1e020;
-	static const uint16_t code_mips[] = {
-		0xb207, /* lw $v0, 2f */
-		0x9a80, /* lw $a0, 0($v0) # addr */
-		0x9aa1, /* lw $a1, 4($v0) # num */
-		0xf000, 0x42c8, /* addiu $a2, $v0, 8 # buf */
-		0xe595, /* addu $a1, $a0 # end */
-		0xdac0, /* sw $a2, 0($v0) */
-		/* 1: */
-		0xa460, /* lbu $v1, 0($a0) */
-		0x4c01, /* addiu $a0, 1 */
-		0xc660, /* sb $v1, 0($a2) */
-		0x4e01, /* addiu $a0, 1 */
-		0xecaa, /* cmp $a0, $a1 */
-		0x61fa, /* btnez 1b */
-		0xe8a0, /* jrc $ra */
-		/* 2: */
-		(buf_addr_mips & 0xffff), buf_addr_mips >> 16,
-	};
-
-	const uint32_t code_addr_arm = 0x11e000 + 1;
-	const uint32_t buf_addr_arm = 0x11e020;
-	static const uint16_t code_arm[] = {
-		0x4805, /* ldr r0, 2f */
-		0x0003, /* movs r3, r0 */
-		0xc806, /* ldmia r0!, {r1,r2} */
-		0x6018, /* str r0, [r3] */
-		/* 1: */
-		0xf811, 0x3b01, /* ldrb r3, [r1], #1 */
-		0x3a01, /* subs r2, #1 */
-		0xf800, 0x3b01, /* strb r3, [r0], #1 */
-		0xd1f9, /* bne 1b */
-		0x4800, /* ldr r0, 2f */
-		0x4770, /* bx lr */
-		/* 2: */
-		(buf_addr_arm & 0xffff), buf_addr_arm >> 16,
-	};
-	static const struct {
-		uint32_t addr, buf, size; const uint16_t *code;
-	} code_tab[] = {
-		{ code_addr_mips, buf_addr_mips, sizeof(code_mips), code_mips },
-		{ code_addr_arm, buf_addr_arm, sizeof(code_arm), code_arm },
-	}, *payload;
-
-	payload = &code_tab[adfu_chip == 2157];
-
-	FILE *fo = fopen(fn, "wb");
-	if (!fo) ERR_EXIT("fopen(wb) failed\n");
-
-	if (step > 0x200 - 0x28) step = 0x200 - 0x28;
+#define DUMP_BUFS 8
 
-	for (i = 0; i < size; i += n) {
-		n = size - i;
-		if (n > step) n = step;
+typedef unsigned (*dump_submit_t)(usbio_t *io, void *ctx,
+		uint32_t pos, unsigned n, uint8_t *buf);
 
-		if (!i) {
-			actions_cmd(io, CMD_ADFU_WRITERAM, payload->size, payload->addr & ~1, 0, payload->size);
-			usb_send(io, payload->code, payload->size);
-			if (check_usbs(io, NULL)) break;
-		}
-		{
-			uint32_t buf[2] = { addr + i, n };
-			actions_cmd(io, CMD_ADFU_WRITERAM, 8, payload->buf, 0, 8);
-			usb_send(io, buf, 8);
-			if (check_usbs(io, NULL)) break;
-		}
-		actions_cmd(io, CMD_ADFU_EXEC, 0, payload->addr, 0, 0);
-		if (check_usbs(io, NULL)) break;
-#if 0
-		actions_cmd(io, CMD_ADFU_READRET, n, 0, 1, n);
-#else // safer for ATJ2157
-		actions_cmd(io, CMD_ADFU_READRAM, n, payload->buf + 8, 1, n);
-#endif
-
-		n2 = n + USBS_LEN;
-		if (usb_recv(io, n2) != (int)n2) {
-			ERR_EXIT("unexpected length\n");
-			break;
+/*
+ * Reads "size" units (bytes, or sectors with shift = 9) in chunks of "step"
+ * units to the file, keeping up to DUMP_BUFS chunks in flight.
+ * Returns the number of units written.
+ */
+static uint32_t dump_pipeline(usbio_t *io, dump_file_t *out, uint32_t size,
+		unsigned step, unsigned shift, dump_submit_t submit, void *ctx) {
+	uint8_t *mem; size_t blk = (size_t)step << shift;
+	unsigned seq[DUMP_BUFS], len[DUMP_BUFS];
+	unsigned k = 0, nbuf = 0;
+	// continue after the resumed part
+	uint32_t i = out->done >> shift, pos = i, n;
+
+	mem = (uint8_t*)dump_alloc(blk * DUMP_BUFS);
+	usb_async_flush(io);
+
+	for (;;) {
+		for (; nbuf < DUMP_BUFS && pos < size; nbuf++, pos += n) {
+			unsigned j = (k + nbuf) % DUMP_BUFS;
+			n = size - pos;
+			if (n > step) n = step;
+			len[j] = n;
+			seq[j] = submit(io, ctx, pos, n, mem + j * blk);
 		}
-		if (check_usbs(io, io->buf + n)) break;
-		if (fwrite(io->buf, 1, n, fo) != n)
-			ERR_EXIT("fwrite failed\n");
+		if (!nbuf) break;
+		if (usb_async_wait(io, seq[k])) break;
+		dump_write(out, mem + k * blk, len[k] << shift);
+		i += len[k];
+		k = (k + 1) % DUMP_BUFS; nbuf--;
 	}
-	DBG_LOG("dump_mem: 0x%08x, target: 0x%x, read: 0x%x\n", addr, size, i);
-	fclose(fo);
+	usb_async_flush(io);
+	dump_free(mem);
 	return i;
 }
 
 static void read_mem_buf(usbio_t *io,
 		uint32_t addr, unsigned size, void *mem, unsigned step) {
-	uint32_t i, n, n2;
+	uint32_t i, n;
 
 	for (i = 0; i < size; i += n) {
 		n = size - i;
 		if (n > step) n = step;
 		actions_cmd(io, CMD_ADFU_READRAM, n, addr + i, 1, n);
-		n2 = n + USBS_LEN;
-		if (usb_recv(io, n2) != (int)n2) {
-			ERR_EXIT("unexpected length\n");
-			break;
-		}
-		if (check_usbs(io, io->buf + n))
+		if (usb_recv_buf(io, (uint8_t*)mem + i, n) != (int)n)
+			XFER_EXIT(XFER_TIMEOUT, "unexpected length\n");
+		if (check_usbs(io, NULL))
 			ERR_EXIT("read_mem failed\n");
-		memcpy((uint8_t*)mem + i, io->buf, n);
 	}
 }
 
+static unsigned dump_mem_submit(usbio_t *io, void *ctx,
+		uint32_t pos, unsigned n, uint8_t *buf) {
+	uint32_t addr = *(uint32_t*)ctx + pos;
+	return usb_async_cmd(io, CMD_ADFU_READRAM, n, addr, 1, buf, n);
+}
+
 static unsigned dump_mem(usbio_t *io,
 		uint32_t addr, uint32_t size, const char *fn, unsigned step) {
-	unsigned i, n, n2;
+	unsigned i;
+	dump_file_t out; char desc[64];
+
+	sprintf(desc, "read_mem 0x%x 0x%x\n", addr, size);
+	dump_open(&out, fn, desc, size, 0);
+	i = dump_pipeline(io, &out, size, step, 0, dump_mem_submit, &addr);
+	DBG_LOG("dump_mem: 0x%08x, target: 0x%x, read: 0x%x\n", addr, size, i);
+	dump_close(&out, i == size);
+	return i;
+}
+
+static unsigned dump_mem2_submit(usbio_t *io, void *ctx,
+		uint32_t pos, unsigned n, uint8_t *buf) {
+	uint32_t addr = *(uint32_t*)ctx + pos;
+	return usb_async_cmd(io, CMD_ADFU_READCOPY, n, addr, 1, buf, n);
+}
+
+// the same as read_mem, but adfus copies the data (can read ROM)
+static unsigned dump_mem2(usbio_t *io,
+		uint32_t addr, uint32_t size, const char *fn, unsigned step) {
+	unsigned i;
+	dump_file_t out; char desc[64];
 
-	FILE *fo = fopen(fn, "wb");
-	if (!fo) ERR_EXIT("fopen(wb) failed\n");
+	sprintf(desc, "read_mem2 0x%x 0x%x\n", addr, size);
+	dump_open(&out, fn, desc, size, 0);
+	i = dump_pipeline(io, &out, size, step, 0, dump_mem2_submit, &addr);
+	DBG_LOG("dump_mem: 0x%08x, target: 0x%x, read: 0x%x\n", addr, size, i);
+	dump_close(&out, i == size);
+	return i;
+}
 
-	for (i = 0; i < size; i += n) {
+// must match payload/lz.h
+#define LZ_HASH_BITS 11
+#define LZ_BOUND(n) ((n) + (n) / 255 + 16)
+
+/*
+ * Decodes an LZ4 block, returns the decoded size or -1 on error.
+ */
+static int lz_decompress(uint8_t *dst, unsigned dn,
+		const uint8_t *src, unsigned sn) {
+	const uint8_t *s = src, *end = src + sn;
+	uint8_t *d = dst, *dend = dst + dn;
+	unsigned tok, n, off;
+
+	while (s < end) {
+		tok = *s++;
+		n = tok >> 4;
+		if (n == 15) do {
+			if (s == end) return -1;
+			n += *s;
+		} while (*s++ == 255);
+		if ((unsigned)(end - s) < n || (unsigned)(dend - d) < n) return -1;
+		memcpy(d, s, n); d += n; s += n;
+		if (s == end) break;
+
+		if (end - s < 2) return -1;
+		off = s[0] | s[1] << 8; s += 2;
+		if (!off || off > (unsigned)(d - dst)) return -1;
+		n = tok & 15;
+		if (n == 15) do {
+			if (s == end) return -1;
+			n += *s;
+		} while (*s++ == 255);
+		n += 4;
+		if ((unsigned)(dend - d) < n) return -1;
+		for (; n; n--, d++) *d = d[-(int)off];
+	}
+	return d - dst;
+}
+
+static void lz_report(const char *name, uint64_t raw, uint64_t packed,
+		uint64_t total, uint64_t time) {
+	if (raw)
+		DBG_LOG("%s: compressed 0x%llx -> 0x%llx (%.1f%%)\n", name,
+				(long long)raw, (long long)packed, packed * 100.0 / raw);
+	if (time)
+		DBG_LOG("%s: 0x%llx bytes in %.2fs, %.2f MB/s\n", name,
+				(long long)total, time / 1e6, (double)total / time);
+}
+
+// the boot ROM has no jobs, the result is requested after the exec
+static unsigned dump_memz_start(usbio_t *io, const uint32_t *cfg,
+		uint32_t addr, unsigned n, uint32_t ring, uint8_t *args, uint8_t *ret) {
+	WRITE32_LE(args, cfg[2]);
+	WRITE32_LE(args + 4, addr);
+	WRITE32_LE(args + 8, n);
+	WRITE32_LE(args + 12, ring);
+	usb_async_cmd(io, CMD_ADFU_WRITERAM, 16, cfg[1], 0, args, 16);
+	if (io->switched) {
+		if (adfu_job_start(io, cfg[0])) ERR_EXIT("job failed\n");
+		return 0;
+	}
+	usb_async_cmd(io, CMD_ADFU_EXEC, 0, cfg[0], 0, NULL, 0);
+	return usb_async_cmd(io, CMD_ADFU_RETSIZE, 4, 0, 1, ret, 4);
+}
+
+/*
+ * Reads memory with the memread payload, which compresses a chunk
+ * per exec. With adfus, the next chunk is compressed as a job
+ * to the other ring while the previous one is read.
+ */
+static unsigned dump_memz(usbio_t *io, const char *code_fn,
+		uint32_t addr, uint32_t size, const char *fn, unsigned step) {
+	// code, args (p + 12), hash table, rings, chunk size
+	static const uint32_t cfg_mips[] = {
+		0xbfc1e000, 0x9fc1ffec, 0xbfc1a000, 0xbfc20000, 0xbfc28000, 0x7e00 };
+	static const uint32_t cfg_arm[] = {
+		0x11e000, 0x11ffec, 0x11a000, 0x120000, 0x124000, 0x3e00 };
+	const uint32_t *cfg = io->chip == 2157 ? cfg_arm : cfg_mips;
+	uint32_t i, j, n, k, len, chunk = cfg[5], src, start;
+	uint64_t packed = 0, time;
+	uint8_t args[16], ret[4], *mem, *comp;
+	unsigned seq = 0, wait = 0, r = 0;
+	dump_file_t out; char desc[64];
+
+	mem = (uint8_t*)dump_alloc(chunk + LZ_BOUND(chunk));
+	comp = mem + chunk;
+
+	sprintf(desc, "read_mem 0x%x 0x%x\n", addr, size);
+	dump_open(&out, fn, desc, size, 0);
+	start = out.done;
+
+	write_mem(io, cfg[0] & ~1, 0, 0, code_fn, step);
+	time = get_time_usec();
+
+	n = size - start < chunk ? size - start : chunk;
+	if (n) wait = dump_memz_start(io, cfg, addr + start, n, cfg[3], args, ret);
+	for (i = start; i < size; i += n, r ^= 1) {
 		n = size - i;
-		if (n > step) n = step;
-		actions_cmd(io, CMD_ADFU_READRAM, n, addr + i, 1, n);
-		n2 = n + USBS_LEN;
-		if (usb_recv(io, n2) != (int)n2) {
-			ERR_EXIT("unexpected length\n");
-			break;
+		if (n > chunk) n = chunk;
+		if (io->switched ? adfu_job_wait(io, ret) : usb_async_wait(io, wait)) break;
+		len = READ32_LE(ret);
+		if (!len || len > n) ERR_EXIT("unexpected compressed size\n");
+		if (size - i > n) {
+			k = size - i - n;
+			if (k > chunk) k = chunk;
+			wait = dump_memz_start(io, cfg, addr + i + n, k, cfg[3 + !r], args, ret);
 		}
-		if (check_usbs(io, io->buf + n)) break;
-		if (fwrite(io->buf, 1, n, fo) != n)
-			ERR_EXIT("fwrite failed\n");
+		// the source is returned if it doesn't compress
+		src = len < n ? cfg[3 + r] : addr + i;
+		for (j = 0; j < len; j += k) {
+			k = len - j;
+			if (k > step) k = step;
+			seq = usb_async_cmd(io, CMD_ADFU_READRAM, k, src + j, 1,
+					(len < n ? comp : mem) + j, k);
+		}
+		if (usb_async_wait(io, seq)) break;
+		if (len < n && lz_decompress(mem, n, comp, len) != (int)n)
+			ERR_EXIT("decompression failed\n");
+		packed += len;
+		dump_write(&out, mem, n);
 	}
+	usb_async_flush(io);
 	DBG_LOG("dump_mem: 0x%08x, target: 0x%x, read: 0x%x\n", addr, size, i);
-	fclose(fo);
+	lz_report("read_mem_lz", i - start, packed, i - start, get_time_usec() - time);
+	dump_close(&out, i == size);
+	dump_free(mem);
 	return i;
 }
 
+/*
+ * On ATJ2157 adfus sends (or receives) a block while reading (or programming)
+ * the other, so the flash commands are long enough to keep both busy.
+ */
+#define FLASH_CMD_LEN 0x20000
+
+static unsigned dump_lfi_submit(usbio_t *io, void *ctx,
+		uint32_t pos, unsigned n, uint8_t *buf) {
+	uint32_t addr = *(uint32_t*)ctx + pos;
+	return usb_async_cmd(io, CMD_ADFU_FLASH, n, addr | 0x80 << 24, 1, buf, n << 9);
+}
+
 static unsigned dump_lfi(usbio_t *io,
-		uint32_t addr, uint32_t size, const char *fn, unsigned step) {
-	unsigned i, n0, n, n2;
-
-	FILE *fo = fopen(fn, "wb");
-	if (!fo) ERR_EXIT("fopen(wb) failed\n");
-
-	step >>= 9;
-	if (!step) step = 1;
-
-	for (i = 0; i < size; i += n0) {
-		n0 = size - i;
-		if (n0 > step) n0 = step;
-		n = n0 << 9;
-		actions_cmd(io, CMD_ADFU_FLASH, n0, (addr + i) | 0x80 << 24, 1, n);
-		n2 = n + USBS_LEN;
-		if (usb_recv(io, n2) != (int)n2) {
-			ERR_EXIT("unexpected length\n");
-			break;
-		}
-		if (check_usbs(io, io->buf + n)) break;
-		if (fwrite(io->buf, 1, n, fo) != n)
-			ERR_EXIT("fwrite failed\n");
-	}
+		uint32_t addr, uint32_t size, const char *fn) {
+	unsigned i, step = FLASH_CMD_LEN >> 9;
+	dump_file_t out; char desc[64];
+
+	sprintf(desc, "read_lfi 0x%x 0x%x\n", addr, size);
+	dump_open(&out, fn, desc, (uint64_t)size << 9, 0);
+
+	i = dump_pipeline(io, &out, size, step, 9, dump_lfi_submit, &addr);
 	DBG_LOG("dump_lfi: 0x%08llx, target: 0x%llx, read: 0x%llx\n",
 			(long long)addr << 9, (long long)size << 9, (long long)i << 9);
-	fclose(fo);
+	dump_close(&out, i == size);
 	return i;
 }
 
+// flash commands per input chunk, if the input is read to a buffer
+#define FLASH_BATCH 4
+
+// queued without waiting for the status, the data must stay until sent
+static unsigned write_flash_buf(usbio_t *io,
+		uint32_t addr, unsigned size, const void *mem) {
+	uint32_t i, n; unsigned seq = 0;
+
+	for (i = 0; i < size; i += n) {
+		n = size - i;
+		if (n > FLASH_CMD_LEN) n = FLASH_CMD_LEN;
+		seq = usb_async_cmd(io, CMD_ADFU_FLASH, n >> 9, addr + (i >> 9),
+				0, (uint8_t*)mem + i, n);
+	}
+	return seq;
+}
+
+// a failed command fails all queued after it, so the last status is enough
+static void write_flash_wait(usbio_t *io, unsigned seq, int *queued) {
+	if (!*queued) return;
+	*queued = 0;
+	if (usb_async_wait(io, seq))
+		ERR_EXIT("write_flash failed\n");
+}
+
 static void write_flash(usbio_t *io,
 		uint32_t addr, unsigned src_offs, unsigned src_size,
-		const char *fn, unsigned step) {
-	uint8_t *mem; size_t size = 0;
-	unsigned i, n0, n;
-	mem = loadfile(fn, &size);
-	if (!mem) ERR_EXIT("loadfile(\"%s\") failed\n", fn);
-	if (size >> 32) ERR_EXIT("file too big\n");
-	if (size < src_offs)
-		ERR_EXIT("data outside the file\n");
-	size -= src_offs;
-	if (src_size) {
-		if (size < src_size)
-			ERR_EXIT("data outside the file\n");
-		size = src_size;
+		const char *fn) {
+	input_t in; const uint8_t *mem;
+	size_t n, unit; uint64_t i = 0, done = 0, same = 0;
+	// only the firmware area can be read back
+	int fwim = addr >> 24 == 0xc0;
+	int verify = write_verify && fwim, diff = write_diff && fwim;
+	uint32_t crc = 0, sector = addr & 0xffffff, list[DIFF_BATCH];
+	unsigned seq = 0; int queued = 0;
+
+	if ((write_verify || write_diff) && !fwim)
+		DBG_LOG("verify/diff: not supported for 0x%02x\n", addr >> 24);
+	input_open(&in, fn, src_offs, src_size);
+	if (in.size != INPUT_STREAM) {
+		if (in.size >> 32) ERR_EXIT("file too big\n");
+		if (in.size & 0x1ff)
+			ERR_EXIT("must be aligned by 512\n");
 	}
+	// --verify waits for each chunk anyway
+	unit = diff ? VERIFY_LEN * DIFF_BATCH :
+			verify ? FLASH_CMD_LEN : FLASH_CMD_LEN * FLASH_BATCH;
+
+	for (;;) {
+		// a mapped file stays, but the buffer is read again
+		if (!in.map) write_flash_wait(io, seq, &queued);
+		mem = input_read(&in, unit, &n);
+		// a pipe ends at an unknown size
+		if (n & 0x1ff)
+			ERR_EXIT("must be aligned by 512\n");
+		if (diff) {
+			size_t j, k;
+			if (!n) break;
+			// program only the chunks that differ
+			write_flash_wait(io, seq, &queued);
+			adfu_crc32(io, 0x80, sector + i, n >> 9, VERIFY_LEN >> 9, list);
+			for (j = 0; j < n; j += k) {
+				k = n - j;
+				if (k > VERIFY_LEN) k = VERIFY_LEN;
+				crc = crc32_update(0, mem + j, k);
+				if (crc == list[j / VERIFY_LEN]) {
+					same += k >> 9;
+					continue;
+				}
+				seq = write_flash_buf(io, addr + i + (j >> 9), k, mem + j);
+				queued = 1;
+				if (verify) {
+					write_flash_wait(io, seq, &queued);
+					adfu_verify(io, 0x80, sector + i + (j >> 9), k >> 9, crc);
+				}
+			}
+			i += n >> 9;
+			continue;
+		}
+		if (n) {
+			seq = write_flash_buf(io, addr + i, n, mem);
+			queued = 1;
+			if (verify) crc = crc32_update(crc, mem, n);
+			i += n >> 9;
+		}
+		if (verify && i > done && (!n || (i - done) << 9 >= VERIFY_LEN)) {
+			write_flash_wait(io, seq, &queued);
+			adfu_verify(io, 0x80, sector + done, i - done, crc);
+			done = i; crc = 0;
+		}
+		if (!n) break;
+	}
+	write_flash_wait(io, seq, &queued);
+	input_close(&in);
+	if (diff)
+		DBG_LOG("write_flash: 0x%llx of 0x%llx sectors unchanged\n",
+				(long long)same, (long long)i);
+}
 
-	if (size & 0x1ff)
-		ERR_EXIT("must be aligned by 512\n");
-	size >>= 9;
-	step >>= 9;
-	if (!step) step = 1;
-
-	for (i = 0; i < size; i += n0) {
-		n0 = size - i;
-		if (n0 > step) n0 = step;
-		n = n0 << 9;
-		actions_cmd(io, CMD_ADFU_FLASH, n0, addr + i, 0, n);
-		usb_send(io, mem + (i << 9), n);
-		if (check_usbs(io, NULL))
-			ERR_EXIT("write_flash failed\n");
+/*
+ * Waits until the switched code answers a read of its first word,
+ * instead of sleeping for a fixed time.
+ */
+static int adfu_probe(usbio_t *io, uint32_t addr) {
+	usbc_cmd_t usbc; uint8_t buf[4];
+	int i, n = 40, timeout = io->timeout;
+
+	io->timeout = 5;
+	for (i = 0; i < n; i++) {
+		if (i) usleep(500);
+		actions_cbw(&usbc, CMD_ADFU_READRAM, 4, addr, 1, 4);
+		if (usb_write(io, (uint8_t*)&usbc, USBC_LEN) != USBC_LEN) continue;
+		if (usb_recv_buf(io, buf, 4) == 4 && usb_recv(io, USBS_LEN) == USBS_LEN &&
+				READ32_LE(io->buf) == USBS_SIG && !io->buf[12]) break;
+		// drop a partial response
+		usb_recv(io, TEMP_BUF_LEN);
+		io->recv_len = io->recv_pos = 0;
 	}
-	free(mem);
+	io->timeout = timeout;
+	if (i && i < n && io->verbose)
+		DBG_LOG("switch: ready after %d probes\n", i + 1);
+	return i == n;
 }
 
 static void adfu_switch(usbio_t *io, uint32_t addr) {
-	if (!adfu_chip) {
-		if (addr >> 20 == 0xbfc) adfu_chip = 2127;
-		if (addr >> 20 == 1) adfu_chip = 2157;
+	if (!io->chip) {
+		if (addr >> 20 == 0xbfc) io->chip = 2127;
+		if (addr >> 20 == 1) io->chip = 2157;
 	}
 	actions_cmd(io, CMD_ADFU_SWITCH, 0, addr, 0, 0);
 	if (check_usbs(io, NULL))
 		ERR_EXIT("switch failed\n");
-	usleep(10000); // 10ms timeout for proper init
+	if (adfu_probe(io, addr & ~3))
+		ERR_EXIT("no response after switch\n");
+	io->switched = 1;
 }
 
+static int adfu_result(usbio_t *io, int32_t len);
+
 static int adfu_exec(usbio_t *io, uint32_t addr, int32_t len) {
+	uint64_t time = trace_buf ? get_time_usec() : 0;
+	int ret;
 	actions_cmd(io, CMD_ADFU_EXEC, 0, addr, 0, 0);
 	if (check_usbs(io, NULL)) return -1;
+	ret = adfu_result(io, len);
+	if (time) trace_span("exec", time, get_time_usec(), addr, 0);
+	return ret;
+}
 
+// reads the result of the last exec
+static int adfu_result(usbio_t *io, int32_t len) {
 	if (len == -1) {
 		actions_cmd(io, CMD_ADFU_RETSIZE, 4, 0, 1, 4);
 		if (usb_recv(io, 4) != 4) {
@@ -671,20 +2567,67 @@ static int adfu_exec(usbio_t *io, uint32_t addr, int32_t len) {
 		DBG_LOG("requested length too long (0x%x)\n", len);
 		return -1;
 	} else if (len) {
+		uint8_t *mem = (uint8_t*)malloc(len);
+		if (!mem) ERR_EXIT("malloc failed\n");
 		actions_cmd(io, CMD_ADFU_READRET, len, 0, 1, len);
-		if (usb_recv(io, len) != len) {
+		if (usb_recv_buf(io, mem, len) != len) {
 			DBG_LOG("unexpected response\n");
+			free(mem);
 			return -1;
 		}
 		if (io->verbose < 2) {
 			DBG_LOG("result (%d):\n", len);
-			print_mem(stderr, io->buf, len);
+			print_mem(LOG_FILE, mem, len);
 		}
+		free(mem);
 		if (check_usbs(io, NULL)) return -1;
 	}
 	return 0;
 }
 
+/*
+ * A script runs a sequence of commands on the device (adfus) with one
+ * exchange for the script and one for the output, see payload/adfus.c.
+ */
+enum {
+	SCR_END, SCR_STORE, SCR_ADD, SCR_EXEC,
+	SCR_COPY, SCR_APPEND, SCR_APPEND_RET, SCR_LOOP
+};
+#define SCRIPT_MAX 0x400
+
+typedef struct {
+	unsigned len;
+	uint8_t buf[SCRIPT_MAX];
+} adfu_script_t;
+
+static void script_word(adfu_script_t *s, uint32_t x) {
+	if (s->len + 4 > SCRIPT_MAX) ERR_EXIT("script too long\n");
+	WRITE32_LE(s->buf + s->len, x);
+	s->len += 4;
+}
+
+static void script_op(adfu_script_t *s, int op, uint32_t a, uint32_t b) {
+	script_word(s, op);
+	script_word(s, a);
+	if (op != SCR_EXEC) script_word(s, b);
+}
+
+// the words are little-endian
+static void script_store(adfu_script_t *s, uint32_t addr, const void *data, unsigned n) {
+	script_word(s, SCR_STORE | n << 8);
+	script_word(s, addr);
+	if (s->len + n * 4 > SCRIPT_MAX) ERR_EXIT("script too long\n");
+	memcpy(s->buf + s->len, data, n * 4);
+	s->len += n * 4;
+}
+
+// queues the script, the data and the script must stay until it's done
+static unsigned adfu_script(usbio_t *io, adfu_script_t *s, void *out, unsigned len) {
+	script_word(s, SCR_END);
+	usb_async_cmd(io, CMD_ADFU_SCRIPT, s->len, 0, 0, s->buf, s->len);
+	return usb_async_cmd(io, CMD_ADFU_RUNSCRIPT, len, 0, 1, out, len);
+}
+
 static unsigned adfu_checksum(const void *addr, unsigned n) {
 	const uint16_t *p = addr;
 	unsigned i, sum = 0;
@@ -692,28 +2635,46 @@ static unsigned adfu_checksum(const void *addr, unsigned n) {
 	return *p ^ (uint16_t)(sum + 0x1234);
 }
 
+// udata[8], status, ECC | fill << 8
+#define NAND_TRAILER 16
+#define NAND_FILL(t) ((t)[13])
+
 typedef struct {
 	uint32_t code_addr, buf_addr, args_addr, nand_args;
+	uint32_t ring_addr, ring_size;
 	uint8_t *mem; unsigned psize, blk_size;
+	uint32_t *list; uint8_t *trailer;
+	// compression of batches
+	int lz; uint32_t lz_hash; uint8_t *lz_buf;
+	uint64_t lz_raw, lz_packed;
 } nandread_t;
 
 static void nandread_init(usbio_t *io, nandread_t *x, const char *nandread_fn,
-		const char *mbrec_fn, unsigned blk_size) {
+		const char *mbrec_fn, unsigned blk_size, int lz) {
 	unsigned n, psize;
 	uint8_t *mem, buf[8];
 
-	if (adfu_chip == 2157) {
+	if (io->chip == 2157) {
 		x->code_addr = 0x11e000;
 		x->buf_addr = 0x11a000;
 		x->args_addr = 0x11fff0;
 		x->nand_args = 0x100920;
+		x->ring_addr = 0x120000;
+		x->ring_size = 0x8000;
 	} else {
 		x->code_addr = 0xbfc1e000;
 		x->buf_addr = 0xbfc1a000;
 		x->args_addr = 0x9fc1fff0;
 		x->nand_args = 0xbfc341e0;
+		x->ring_addr = 0xbfc20000;
+		x->ring_size = 0x10000;
 	}
 	x->blk_size = blk_size;
+	// after the list of a batch
+	x->lz_hash = x->buf_addr + 0x1000;
+	x->lz = lz;
+	x->lz_buf = NULL;
+	x->lz_raw = x->lz_packed = 0;
 
 	write_mem(io, x->code_addr & ~1, 0, 0, nandread_fn, blk_size);
 	WRITE32_LE(buf, 3);
@@ -727,8 +2688,7 @@ static void nandread_init(usbio_t *io, nandread_t *x, const char *nandread_fn,
 	if (READ32_LE(buf) != 0x12345678)
 		ERR_EXIT("read mbrec failed\n");
 
-	mem = malloc(0x400 + 0x10000);
-	if (!mem) ERR_EXIT("malloc failed\n");
+	mem = (uint8_t*)dump_alloc(0x400 + 0x10000);
 	x->mem = mem;
 	read_mem_buf(io, x->buf_addr, 0x400, mem, blk_size);
 
@@ -737,7 +2697,7 @@ static void nandread_init(usbio_t *io, nandread_t *x, const char *nandread_fn,
 	else ERR_EXIT("bad mbrec\n");
 
 	if (mbrec_fn) {
-		FILE *fo = fopen(mbrec_fn, "wb");
+		FILE *fo = fopen_out(mbrec_fn);
 		if (!fo) ERR_EXIT("fopen(mbrec) failed\n");
 		if (fwrite(mem, 1, n, fo) != n)
 			ERR_EXIT("fwrite failed\n");
@@ -750,16 +2710,203 @@ static void nandread_init(usbio_t *io, nandread_t *x, const char *nandread_fn,
 	x->psize = psize;
 	if (READ16_LE(mem + 0xc) == 0)
 		ERR_EXIT("invalid nand config\n");
+
+	// the list of a batch is stored in the page buffer
+	n = x->ring_size / psize;
+	// with the compressed size after the trailers
+	x->list = (uint32_t*)dump_alloc((n + 1) * 4 + n * NAND_TRAILER + 4);
+	x->trailer = (uint8_t*)(x->list + n + 1);
+
+	if (lz) {
+		// compressed data and the packed pages
+		x->lz_buf = (uint8_t*)dump_alloc(x->ring_size * 2);
+	}
 }
 
-static void nandread_read(usbio_t *io, nandread_t *x, uint32_t rowaddr, uint8_t *mem, uint32_t size) {
-	uint8_t buf[4];
-	WRITE32_LE(buf, rowaddr);
-	write_mem_buf(io, x->nand_args, 4, buf, 4);
-	actions_cmd(io, CMD_ADFU_EXEC, 0, x->code_addr, 0, 0); 
-	if (check_usbs(io, NULL)) ERR_EXIT("exec failed\n");
-	if (mem && size)
-		read_mem_buf(io, x->buf_addr, size, mem, x->blk_size);
+/*
+ * Reads the pages with one exec per batch, the pages are followed by
+ * their trailers in the ring. Both "mem" and "oob" can be NULL.
+ * The device drops erased and zero pages, these are filled here.
+ * With compression, the packed pages are compressed after the trailers.
+ */
+static void nandread_batch(usbio_t *io, nandread_t *x,
+		const uint32_t *rows, unsigned n, uint8_t *mem, uint8_t *oob) {
+	unsigned i, j, k, seq, max = x->ring_size / (x->psize + NAND_TRAILER);
+	uint32_t *list = x->list, size, addr, len;
+	uint8_t args[20], *buf, *t, *packed;
+	adfu_script_t scr;
+	int lz = 0;
+
+	if (x->lz && mem) {
+		k = (x->ring_size - 16) / (x->psize * 2 + x->psize / 255 + 1 + NAND_TRAILER);
+		if (k) lz = 1, max = k;
+	}
+
+	WRITE32_LE(args, x->lz_hash);
+	WRITE32_LE(args + 4, lz ? 8 | 0x20 : 8);
+	WRITE32_LE(args + 8, x->buf_addr);
+	WRITE32_LE(args + 12, x->ring_addr);
+	WRITE32_LE(args + 16, x->buf_addr);
+
+	for (; n; n -= j, rows += j) {
+		j = n < max ? n : max;
+		size = j * x->psize;
+		WRITE32_LE(list, j);
+		for (i = 0; i < j; i++) WRITE32_LE(list + i + 1, rows[i]);
+
+		// the trailers and the compressed size come in one data phase
+		scr.len = 0;
+		script_store(&scr, x->buf_addr, list, j + 1);
+		// the hash table address goes before the flags
+		script_store(&scr, x->args_addr - 4, args, 5);
+		script_op(&scr, SCR_EXEC, x->code_addr, 0);
+		t = x->trailer;
+		k = mem || oob ? j * NAND_TRAILER : 0;
+		if (k) script_op(&scr, SCR_APPEND, x->ring_addr + size, k);
+		if (lz) script_op(&scr, SCR_APPEND_RET, 4, 4);
+		buf = t + k;
+		usb_async_flush(io);
+		seq = adfu_script(io, &scr, t, k + lz * 4);
+		if (usb_async_wait(io, seq)) ERR_EXIT("nandread failed\n");
+		usb_async_flush(io);
+		if (!mem) {
+			if (oob) {
+				memcpy(oob, t, k);
+				oob += k;
+			}
+			continue;
+		}
+
+		// only the pages with data are sent, packed together
+		packed = NULL;
+		if (lz && (len = READ32_LE(buf))) {
+			for (k = i = 0; i < j; i++)
+				if (!NAND_FILL(t + i * NAND_TRAILER)) k += x->psize;
+			if (len >= k) ERR_EXIT("unexpected compressed size\n");
+			packed = x->lz_buf + x->ring_size;
+			read_mem_buf(io, x->ring_addr + size + j * NAND_TRAILER,
+					len, x->lz_buf, x->blk_size);
+			if (lz_decompress(packed, k, x->lz_buf, len) != (int)k)
+				ERR_EXIT("decompression failed\n");
+			x->lz_raw += k;
+			x->lz_packed += len;
+		}
+		addr = x->ring_addr;
+		for (i = 0; i < j; i++, mem += x->psize) {
+			unsigned fill = NAND_FILL(t + i * NAND_TRAILER);
+			if (fill) {
+				memset(mem, fill == 1 ? 0xff : 0, x->psize);
+				continue;
+			}
+			if (packed) {
+				memcpy(mem, packed, x->psize);
+				packed += x->psize;
+				continue;
+			}
+			for (len = 0; len < x->psize; len += k) {
+				k = x->psize - len;
+				if (k > x->blk_size) k = x->blk_size;
+				seq = usb_async_cmd(io, CMD_ADFU_READRAM, k, addr, 1, mem + len, k);
+				addr += k;
+			}
+		}
+		if (addr != x->ring_addr) {
+			if (usb_async_wait(io, seq)) ERR_EXIT("nandread failed\n");
+			usb_async_flush(io);
+			if (lz) x->lz_raw += addr - x->ring_addr, x->lz_packed += addr - x->ring_addr;
+		}
+		if (oob) {
+			memcpy(oob, t, j * NAND_TRAILER);
+			oob += j * NAND_TRAILER;
+		}
+	}
+}
+
+/*
+ * Scans the blocks on the device, stores the {block, udata[8]} entries
+ * whose first udata halfword matches (mask | value << 16) to the table.
+ * Returns the number of entries.
+ */
+static unsigned nandread_scan(usbio_t *io, nandread_t *x, unsigned nblock,
+		unsigned npages, uint32_t readmsk, uint32_t match, uint8_t *tab) {
+	unsigned i, k = 0, n, seq, size, max = (x->ring_size - 0x20 - 4) / 12;
+	uint32_t table = x->ring_addr + 0x20;
+	uint8_t args[16], desc[24], buf[4], *mem;
+
+	mem = (uint8_t*)dump_alloc(4 + max * 12);
+
+	WRITE32_LE(args, 0x10);
+	WRITE32_LE(args + 4, x->buf_addr);
+	WRITE32_LE(args + 8, table);
+	WRITE32_LE(args + 12, x->ring_addr);
+
+	for (i = 0; i < nblock; i += n) {
+		WRITE32_LE(desc, i);
+		WRITE32_LE(desc + 4, nblock - i);
+		WRITE32_LE(desc + 8, npages);
+		WRITE32_LE(desc + 12, readmsk);
+		WRITE32_LE(desc + 16, match);
+		WRITE32_LE(desc + 20, max);
+
+		usb_async_flush(io);
+		usb_async_cmd(io, CMD_ADFU_WRITERAM, 24, x->ring_addr, 0, desc, 24);
+		usb_async_cmd(io, CMD_ADFU_WRITERAM, 16, x->args_addr, 0, args, 16);
+		usb_async_cmd(io, CMD_ADFU_EXEC, 0, x->code_addr, 0, NULL, 0);
+		seq = usb_async_cmd(io, CMD_ADFU_RETSIZE, 4, 0, 1, buf, 4);
+		if (usb_async_wait(io, seq)) ERR_EXIT("nandread failed\n");
+		usb_async_flush(io);
+
+		size = READ32_LE(buf);
+		if (size < 4 || size > 4 + max * 12 || (size - 4) % 12)
+			ERR_EXIT("unexpected scan result\n");
+		read_mem_buf(io, table, size, mem, x->blk_size);
+		n = READ32_LE(mem);
+		if (!n || n > nblock - i)
+			ERR_EXIT("unexpected scan result\n");
+		memcpy(tab + k * 12, mem + 4, size - 4);
+		k += (size - 4) / 12;
+	}
+	dump_free(mem);
+	return k;
+}
+
+static void print_udata(uint32_t rowaddr, const uint8_t *buf) {
+	fprintf(OUT_FILE, "0x%x: %02x %02x %02x %02x  %02x %02x %02x %02x\n", rowaddr,
+			buf[0], buf[1], buf[2], buf[3], buf[4], buf[5], buf[6], buf[7]);
+}
+
+/*
+ * Writes the first "size" bytes of the pages to the file, and the
+ * trailers to the OOB file. Any of the files can be NULL.
+ */
+static void nandread_dump(usbio_t *io, nandread_t *x, dump_file_t *out, FILE *fo_oob,
+		int tags, const uint32_t *rows, unsigned n, uint64_t size) {
+	unsigned i, j, k, max = x->ring_size / (x->psize + NAND_TRAILER);
+	uint8_t *mem = (uint8_t*)dump_alloc(x->ring_size), *oob;
+	oob = mem + max * x->psize;
+
+	for (i = 0; i < n; i += k) {
+		uint64_t len = 0;
+		k = n - i;
+		if (k > max) k = max;
+		nandread_batch(io, x, rows + i, k, out ? mem : NULL,
+				fo_oob || tags ? oob : NULL);
+		if (tags)
+			for (j = 0; j < k; j++)
+				print_udata(rows[i + j], oob + j * NAND_TRAILER);
+		// the OOB goes first, the journal entry is for both
+		len = k * NAND_TRAILER;
+		if (fo_oob && fwrite(oob, 1, len, fo_oob) != len)
+			ERR_EXIT("fwrite failed\n");
+		if (fo_oob) fflush(fo_oob);
+		if (out) {
+			len = (uint64_t)k * x->psize;
+			if (len > size) len = size;
+			dump_write(out, mem, len);
+			size -= len;
+		}
+	}
+	dump_free(mem);
 }
 
 static void nandread_end(usbio_t *io, nandread_t *x) {
@@ -768,105 +2915,137 @@ static void nandread_end(usbio_t *io, nandread_t *x) {
 	write_mem_buf(io, x->args_addr, 4, buf, 4);
 	actions_cmd(io, CMD_ADFU_EXEC, 0, x->code_addr, 0, 0);
 	if (check_usbs(io, NULL)) ERR_EXIT("exec failed\n");
-	free(x->mem);
+	dump_free(x->list);
+	dump_free(x->lz_buf);
+	dump_free(x->mem);
+}
+
+// brec pages can be scattered within the block
+static unsigned brec_rows(const uint8_t *mem, uint32_t addr,
+		uint32_t *rows, unsigned i, unsigned n) {
+	for (; i < n; i++) {
+		rows[i] = addr;
+		if (!mem[0x3c0]) addr++;
+		else {
+			if (i >= 0x3c) return i + 1;
+			addr += mem[0x3c5 + i] - mem[0x3c4 + i];
+		}
+	}
+	return n;
 }
 
 static uint32_t dump_brec(usbio_t *io, nandread_t *x,
 		unsigned brec_idx, const char *brec_fn) {
 	uint8_t *mem = x->mem;
-	unsigned i, n, psize = x->psize;
-	uint32_t fw_size = 0;
-	FILE *fo;
+	unsigned n, psize = x->psize;
+	uint32_t fw_size = 0, *rows = NULL;
+	dump_file_t out;
 
+	out.fo = NULL;
 	do {
-		unsigned n2, k, last;
-		uint32_t addr; uint8_t *mem2;
+		unsigned n2, k, last, brec_sec, brec2_sec;
 
 		if (mem[2] != 0x5a) {
 			DBG_LOG("unsupported mbrec size\n");
 			break;
 		}
-		fo = NULL;
-		if (brec_fn) {
-			fo = fopen(brec_fn, "wb");
-			if (!fo) ERR_EXIT("fopen(brec) failed\n");
-		}
+		if (brec_fn) dump_open(&out, brec_fn, NULL, 0, 0);
 
 		n = 0x10000 / psize;
+		rows = (uint32_t*)dump_alloc(n * 4);
 		n2 = READ16_LE(mem + 0xc);
 		if (n2 == 0xc0) n2 = 0x100;
-		addr = mem[3 + brec_idx] * n2;
-
-		mem2 = mem + 0x400; last = psize;
-		for (n2 = n, i = 0; i < n2; i++) {
-			k = i + 1 == n2 ? last : psize;
-			nandread_read(io, x, addr, mem2, k);
-			if (fo && fwrite(mem2, 1, k, fo) != k)
-				ERR_EXIT("fwrite failed\n");
-
-			if (i + 1 < n) mem2 += psize;
-			else if (i + 1 == n) {
-				unsigned brec_sec = READ16_LE(mem + 0x404);
-				unsigned brec2_sec = READ16_LE(mem + 0x406);
-				k = brec_sec << 9;
-				if (k > 0x10000) k = 0x10000;
-				if (adfu_checksum(mem + 0x400, k)) {
-					DBG_LOG("bad brec checksum\n");
-					break;
-				}
-				if (brec2_sec < brec_sec) {
-					DBG_LOG("unexpected brec size\n");
-					break;
-				}
-				fw_size = READ32_LE(mem + 0x408);
-				DBG_LOG("firmware size = 0x%llx\n", (long long)fw_size << 9);
-				if (!fo) break;
-				k = brec2_sec << 9;
-				last = ((k - 1) & (psize - 1)) + 1;
-				n2 = (k + psize - 1) / psize;
-			}
-			if (!mem[0x3c0]) addr++;
-			else {
-				if (i >= 0x3c) {
-					DBG_LOG("unexpected brec size\n");
-					break;
-				}
-				addr += mem[0x3c5 + i] - mem[0x3c4 + i];
+		if (brec_rows(mem, mem[3 + brec_idx] * n2, rows, 0, n) != n) {
+			DBG_LOG("unexpected brec size\n");
+			break;
+		}
+		nandread_batch(io, x, rows, n, mem + 0x400, NULL);
+		if (out.fo) dump_write(&out, mem + 0x400, 0x10000);
+
+		brec_sec = READ16_LE(mem + 0x404);
+		brec2_sec = READ16_LE(mem + 0x406);
+		k = brec_sec << 9;
+		if (k > 0x10000) k = 0x10000;
+		if (adfu_checksum(mem + 0x400, k)) {
+			DBG_LOG("bad brec checksum\n");
+			break;
+		}
+		if (brec2_sec < brec_sec) {
+			DBG_LOG("unexpected brec size\n");
+			break;
+		}
+		fw_size = READ32_LE(mem + 0x408);
+		DBG_LOG("firmware size = 0x%llx\n", (long long)fw_size << 9);
+		if (!out.fo) break;
+		k = brec2_sec << 9;
+		last = ((k - 1) & (psize - 1)) + 1;
+		n2 = (k + psize - 1) / psize;
+		if (n2 > n) {
+			rows = (uint32_t*)dump_realloc(rows, n2 * 4);
+			k = brec_rows(mem, rows[n - 1], rows, n - 1, n2);
+			if (k != n2) {
+				DBG_LOG("unexpected brec size\n");
+				n2 = k; last = psize;
 			}
+			if (n2 > n)
+				nandread_dump(io, x, &out, NULL, 0, rows + n, n2 - n,
+						(uint64_t)(n2 - n - 1) * psize + last);
 		}
-		if (fo) fclose(fo);
 	} while (0);
+	if (out.fo) dump_close(&out, 1);
+	dump_free(rows);
 	return fw_size;
 }
 
-static void dump_nand(usbio_t *io, nandread_t *x,
-		const char *fn, unsigned start, unsigned len, int print_tags) {
-	uint8_t *mem = x->mem;
-	unsigned i, psize = x->psize;
-	FILE *fo = NULL;
-
-	if (fo) {
-		fo = fopen(fn, "wb");
-		if (!fo) ERR_EXIT("fopen(wb) failed\n");
+static void dump_nand(usbio_t *io, nandread_t *x, const char *fn,
+		unsigned start, unsigned len, int print_tags, int oob) {
+	unsigned i = 0, j, k, first, psize = x->psize;
+	FILE *fo_oob = NULL;
+	dump_file_t out;
+	uint32_t rows[0x400];
+	uint64_t time;
+
+	if (fn) {
+		char desc[64];
+		sprintf(desc, "read_nand 0x%x 0x%x 0x%x\n", start, len, psize);
+		dump_open(&out, fn, desc, (uint64_t)len * psize,
+				oob && fd_arg(fn) < 0);
+		// the journal has only whole batches
+		i = out.done / psize;
+		if (oob && fd_arg(fn) >= 0)
+			DBG_LOG("no oob file for a passed descriptor\n");
+		else if (oob) {
+			char *name = out_name(fn, ".oob");
+			if (i) {
+				fo_oob = fopen(name, "r+b");
+				if (fo_oob && (ftruncate(fileno(fo_oob), (off_t)i * NAND_TRAILER) ||
+						fseeko(fo_oob, (off_t)i * NAND_TRAILER, SEEK_SET)))
+					ERR_EXIT("can't resume \"%s\"\n", name);
+			} else fo_oob = fopen(name, "wb");
+			if (!fo_oob) ERR_EXIT("fopen(oob) failed\n");
+			dump_files[2] = fo_oob;
+			free(name);
+		}
 	} else if (!print_tags) return;
 
-	for (i = 0; i < len; i++) {
-		nandread_read(io, x, start + i, fo ? mem : NULL, psize);
-		if (print_tags) {
-			uint8_t buf[8];
-			read_mem_buf(io, x->nand_args + 12, 8, buf, 8);
-			printf("0x%x: %02x %02x %02x %02x  %02x %02x %02x %02x\n", start + i,
-						buf[0], buf[1], buf[2], buf[3], buf[4], buf[5], buf[6], buf[7]);
-		}
-		if (fo && fwrite(mem, 1, psize, fo) != psize)
-			ERR_EXIT("fwrite failed\n");
+	x->lz_raw = x->lz_packed = 0;
+	time = get_time_usec();
+	for (first = i; i < len; i += k) {
+		k = len - i;
+		if (k > 0x400) k = 0x400;
+		for (j = 0; j < k; j++) rows[j] = start + i + j;
+		nandread_dump(io, x, fn ? &out : NULL, fo_oob, print_tags, rows, k, (uint64_t)k * psize);
 	}
-	if (fo) fclose(fo);
+	if (fn) lz_report("read_nand", x->lz_raw, x->lz_packed,
+			(uint64_t)(len - first) * psize, get_time_usec() - time);
+	if (fo_oob) fclose(fo_oob);
+	dump_files[2] = NULL;
+	if (fn) dump_close(&out, 1);
 }
 
 static void find_lfi(usbio_t *io, nandread_t *x, int brec_idx, const char *dump_fn) {
 	uint8_t *mem = x->mem;
-	FILE *fo;
+	dump_file_t out;
 	unsigned i, j, k, err = 0, psize = x->psize;
 	unsigned fw_size, npages, npages2, nblock;
 	uint32_t tab[256];
@@ -880,28 +3059,26 @@ static void find_lfi(usbio_t *io, nandread_t *x, int brec_idx, const char *dump_
 
 	memset(tab, ~0, sizeof(tab));
 
-	// for a faster scan
 	{
-		uint8_t buf[4];
-		uint32_t n = 1;
+		uint8_t *scan; unsigned n = 1;
+		// for a faster scan
 		if (mem[9] <= 0xc) n <<= 1;
-		if (adfu_chip != 2157 && mem[9] >= 0x18) n <<= 1;
-		n = (1 << n) - 1;
-		WRITE32_LE(buf, n);
-		write_mem_buf(io, x->nand_args + 8, 4, buf, 4);
-	}
-
-	for (i = 0; i < nblock; i++) {
-		uint8_t buf[8];
-		nandread_read(io, x, i * npages2, NULL, 0);
-		read_mem_buf(io, x->nand_args + 12, 8, buf, 8);
-		if (buf[0] != 0xff || buf[1] != 0x40) continue;
-		printf("0x%x: %02x %02x %02x %02x  %02x %02x %02x %02x\n", i * npages2,
-				buf[0], buf[1], buf[2], buf[3], buf[4], buf[5], buf[6], buf[7]);
-		if (buf[3] | *(uint32_t*)&buf[4]) continue;
-		j = buf[2];
-		if (~tab[j]) err = 1;
-		tab[j] = i;
+		if (io->chip != 2157 && mem[9] >= 0x18) n <<= 1;
+
+		scan = (uint8_t*)dump_alloc(nblock * 12);
+		// LFI tags: ff 40
+		n = nandread_scan(io, x, nblock, npages2, (1 << n) - 1, 0x40ffffff, scan);
+
+		for (i = 0; i < n; i++) {
+			uint8_t *buf = scan + i * 12 + 4;
+			uint32_t block = READ32_LE(buf - 4);
+			print_udata(block * npages2, buf);
+			if (buf[3] | READ32_LE(buf + 4)) continue;
+			j = buf[2];
+			if (~tab[j]) err = 1;
+			tab[j] = block;
+		}
+		dump_free(scan);
 	}
 	if (err) {
 		DBG_LOG("!!! duplicate tags found\n");
@@ -919,30 +3096,19 @@ static void find_lfi(usbio_t *io, nandread_t *x, int brec_idx, const char *dump_
 	}
 	if (!dump_fn) return;
 
-	// restore old value
+	dump_open(&out, dump_fn, NULL, (uint64_t)k * npages * psize, 0);
+
 	{
-		uint8_t buf[4];
-		uint32_t n = mem[5];
-		if (adfu_chip == 2157 && mem[9] >= 0x18) n >>= 1;
-		n = (2u << (n - 1)) - 1;
-		WRITE32_LE(buf, n);
-		write_mem_buf(io, x->nand_args + 8, 4, buf, 4);
-	}
-
-	fo = fopen(dump_fn, "wb");
-	if (!fo) ERR_EXIT("fopen(wb) failed\n");
-
-	for (i = 0; i < k; i++) {
-		uint32_t addr = tab[i] * npages2;
-		for (j = 0; j < npages; j++) {
-			nandread_read(io, x, addr + j, mem, psize);
-			if (fwrite(mem, 1, psize, fo) != psize)
-				ERR_EXIT("fwrite failed\n");
+		uint32_t *rows = (uint32_t*)dump_alloc(npages * 4);
+		for (i = 0; i < k; i++) {
+			for (j = 0; j < npages; j++) rows[j] = tab[i] * npages2 + j;
+			nandread_dump(io, x, &out, NULL, 0, rows, npages, (uint64_t)npages * psize);
 		}
+		dump_free(rows);
 	}
-	fclose(fo);
+	dump_close(&out, 1);
 
-	printf("The raw LFI dump should contain two copies of the firmware, both may be corrupted in different places, use this command to check and repair the LFI:\n  ./fwhelper <lfi_raw.bin> lfi_repair 0x%x 0x%x 0x%x <lfi_out.bin>\n", fw_size, npages, psize);
+	fprintf(OUT_FILE, "The raw LFI dump should contain two copies of the firmware, both may be corrupted in different places, use this command to check and repair the LFI:\n  ./fwhelper <lfi_raw.bin> lfi_repair 0x%x 0x%x 0x%x <lfi_out.bin>\n", fw_size, npages, psize);
 }
 
 static uint64_t str_to_size(const char *str) {
@@ -965,25 +3131,924 @@ static uint64_t str_to_size(const char *str) {
 
 // need to take control quickly
 #define REOPEN_FREQ 100
+#define RECONNECT_WAIT 30
+
+#if USE_LIBUSB
+static int usb_open_devices(int id_vendor, int id_product, const char *path,
+		libusb_device_handle **handles, char (*paths)[USB_PATH_LEN], int max);
+#endif
+
+/*
+ * Recovers after a transfer error: resets the endpoints after a timeout,
+ * or waits until the device is back on the same port if it has gone.
+ * Returns non-zero if the device doesn't come back.
+ */
+static int usbio_reconnect(usbio_t *io, int gone) {
+	uint64_t time = get_time_usec();
+
+	usb_async_free(io);
+	io->recv_len = io->recv_pos = 0;
+#if USE_LIBUSB
+	if (!gone) {
+		int n;
+		libusb_clear_halt(io->dev_handle, io->endp_in);
+		libusb_clear_halt(io->dev_handle, io->endp_out);
+		// drop a late response
+		libusb_bulk_transfer(io->dev_handle, io->endp_in, io->buf, TEMP_BUF_LEN, &n, 10);
+		return 0;
+	}
+	libusb_close(io->dev_handle);
+	io->dev_handle = NULL;
+	for (;;) {
+		char path[1][USB_PATH_LEN];
+		if (usb_open_devices(io->id_vendor, io->id_product,
+				io->path, &io->dev_handle, path, 1)) break;
+		if (get_time_usec() - time >= RECONNECT_WAIT * 1000000)
+			return io->gone = 1;
+		usleep(1000000 / REOPEN_FREQ);
+	}
+	{
+		int endpoints[2];
+		find_endpoints(io->dev_handle, endpoints);
+		io->endp_in = endpoints[0];
+		io->endp_out = endpoints[1];
+	}
+#else
+	if (!gone) {
+		tcflush(io->serial, TCIOFLUSH);
+		return 0;
+	}
+	close(io->serial);
+	while ((io->serial = open(io->tty, O_RDWR | O_NOCTTY | O_SYNC)) < 0) {
+		if (get_time_usec() - time >= RECONNECT_WAIT * 1000000)
+			return io->gone = 1;
+		usleep(1000000 / REOPEN_FREQ);
+	}
+	init_serial(io->serial);
+	tcflush(io->serial, TCIOFLUSH);
+#endif
+	io->scsi_tag = 1;
+	io->switched = 0;
+	return 0;
+}
 
 static const char* fn_helper(const char *name) {
 	if (!strcmp(name, "-")) return NULL;
 	return name;
 }
 
-int main(int argc, char **argv) {
+/*
+ * adfus splits the long transfers into DMA segments,
+ * so the commands can be longer than the 16K the original tool uses.
+ */
+#define BLK_SIZE_ADFUS 0x40000
+#define BLK_SIZE_MAX (16 << 20)
+// the DMA length of the boot ROM is 16-bit
+#define BLK_SIZE_ROM 0x4000
+
+typedef struct {
+	int blk_size, nand_oob, compress;
+} script_t;
+
+// runs one command, returns the number of arguments used or 0 on failure
+static int run_command(usbio_t *io, script_t *st, int argc, char **argv) {
+	if (!strcmp(argv[1], "verbose")) {
+		if (argc <= 2) ERR_EXIT("bad command\n");
+		io->verbose = atoi(argv[2]);
+		return 2;
+
+	} else if (!strcmp(argv[1], "inquiry")) {
+		usbc_cmd_t usbc; int len = 0x24;
+		WRITE32_LE(&usbc.sig, USBC_SIG);
+		WRITE32_LE(&usbc.tag, io->scsi_tag);
+		WRITE32_LE(&usbc.data_len, len);
+		usbc.flags = 0x80;
+		usbc.lun = 0;
+		usbc.cdb_len = 6;
+		memset(usbc.cdb, 0, 16);
+		usbc.cdb[0] = CMD_INQUIRY;
+		WRITE16_BE(usbc.cdb + 3, len);
+		usb_send(io, &usbc, USBC_LEN);
+
+		if (usb_recv(io, len) != len) {
+			DBG_LOG("unexpected response\n");
+			return 0;
+		}
+		if (io->verbose < 2) {
+			DBG_LOG("result (%d):\n", len);
+			print_mem(LOG_FILE, io->buf, len);
+		}
+		if (check_usbs(io, NULL)) return 0;
+		return 1;
+
+	} else if (!strcmp(argv[1], "adfu_reboot")) {
+		usbc_cmd_t usbc; int len = 11;
+		WRITE32_LE(&usbc.sig, USBC_SIG);
+		WRITE32_LE(&usbc.tag, io->scsi_tag);
+		WRITE32_LE(&usbc.data_len, len);
+		usbc.flags = 0x80;
+		usbc.lun = 0;
+		usbc.cdb_len = 16;
+		memset(usbc.cdb, 0, 16);
+		usbc.cdb[0] = 0xcc;
+		usbc.cdb[7] = len;
+		usb_send(io, &usbc, USBC_LEN);
+		if (usb_recv(io, len) != len ||
+		  	memcmp(io->buf, "ACTIONSUSBD", len)) {
+			DBG_LOG("unexpected response\n");
+			return 0;
+		}
+		if (check_usbs(io, NULL)) return 0;
+
+		len = 2;
+		WRITE32_LE(&usbc.tag, io->scsi_tag);
+		WRITE32_LE(&usbc.data_len, len);
+		usbc.cdb[0] = 0xcb;
+		usbc.cdb[1] = 0x21;
+		usbc.cdb[7] = len;
+		usb_send(io, &usbc, USBC_LEN);
+		if (usb_recv(io, len) != len ||
+				io->buf[0] != 0xff || io->buf[1]) {
+			DBG_LOG("unexpected response\n");
+			return 0;
+		}
+		if (check_usbs(io, NULL)) return 0;
+		return 1;
+
+	} else if (!strcmp(argv[1], "adfu_info")) {
+		usbc_cmd_t usbc; int len = 0x12;
+		io->scsi_tag = 0; // important
+		WRITE32_LE(&usbc.sig, USBC_SIG);
+		WRITE32_LE(&usbc.tag, io->scsi_tag);
+		WRITE32_LE(&usbc.data_len, len);
+		usbc.flags = 0x80;
+		usbc.lun = 0;
+		usbc.cdb_len = 16;
+		memset(usbc.cdb, 0, 16);
+		usbc.cdb[0] = 0xcc;
+		// ATJ2127 return 0x12 bytes
+		// ATJ2157 return the specified amount
+		usbc.cdb[7] = len;
+		usb_send(io, &usbc, USBC_LEN);
+
+		if (usb_recv(io, len) != len) {
+			DBG_LOG("unexpected response\n");
+			return 0;
+		}
+		// "\0CADFUD" ...
+		// ATJ2127: "\x10\xd6"
+		// ATJ2157: "\x30\x51"
+		// ... "A\0\0\0\0\0\0\0\0"
+		if (!memcmp(io->buf, "\0CADFUD", 7)) {
+			int id = io->buf[7] << 8 | io->buf[8];
+			const char *s = NULL;
+			switch (id) {
+			case 0x10d6: s = "ATJ2127"; break;
+			case 0x3051: s = "ATJ2157"; break;
+			}
+			if (s) DBG_LOG("guess: chip = %s\n", s);
+		}
+		if (io->verbose < 2) {
+			DBG_LOG("result (%d):\n", len);
+			print_mem(LOG_FILE, io->buf, len);
+		}
+		if (check_usbs(io, NULL)) return 0;
+		return 1;
+
+	} else if (!strcmp(argv[1], "write_mem")) {
+		const char *fn; uint64_t addr, offset, size;
+		if (argc <= 5) ERR_EXIT("bad command\n");
+
+		addr = str_to_size(argv[2]);
+		offset = str_to_size(argv[3]);
+		size = str_to_size(argv[4]);
+		fn = argv[5];
+		if ((addr | size | offset | (addr + size)) >> 32)
+			ERR_EXIT("32-bit limit reached\n");
+		write_mem(io, addr, offset, size, fn, st->blk_size);
+		return 5;
+
+	} else if (!strcmp(argv[1], "switch")) {
+		uint64_t addr;
+		if (argc <= 2) ERR_EXIT("bad command\n");
+
+		addr = str_to_size(argv[2]);
+		if (addr >> 32) ERR_EXIT("32-bit limit reached\n");
+		adfu_switch(io, addr);
+		st->blk_size = BLK_SIZE_ADFUS;
+		return 2;
+
+	} else if (!strcmp(argv[1], "simple_switch")) {
+		const char *fn; uint64_t addr;
+		if (argc <= 3) ERR_EXIT("bad command\n");
+
+		addr = str_to_size(argv[2]);
+		fn = argv[3];
+		if (addr >> 32) ERR_EXIT("32-bit limit reached\n");
+		write_mem(io, addr & ~1, 0, 0, fn, st->blk_size);
+		adfu_switch(io, addr);
+		st->blk_size = BLK_SIZE_ADFUS;
+		return 3;
+
+	} else if (!strcmp(argv[1], "exec_ret")) {
+		uint64_t addr; int len;
+		if (argc <= 3) ERR_EXIT("bad command\n");
+
+		addr = str_to_size(argv[2]);
+		len = strtol(argv[3], NULL, 0);
+		if (addr >> 32) ERR_EXIT("32-bit limit reached\n");
+		if (adfu_exec(io, addr, len)) return 0;
+		return 3;
+
+	} else if (!strcmp(argv[1], "exec_job")) {
+		uint64_t addr;
+		if (argc <= 2) ERR_EXIT("bad command\n");
+
+		addr = str_to_size(argv[2]);
+		if (addr >> 32) ERR_EXIT("32-bit limit reached\n");
+		if (adfu_job_start(io, addr)) return 0;
+		return 2;
+
+	} else if (!strcmp(argv[1], "job_wait")) {
+		int len;
+		if (argc <= 2) ERR_EXIT("bad command\n");
+
+		len = strtol(argv[2], NULL, 0);
+		if (adfu_job_wait(io, NULL)) return 0;
+		if (adfu_result(io, len)) return 0;
+		return 2;
+
+	} else if (!strcmp(argv[1], "simple_exec")) {
+		const char *fn; uint64_t addr; int len;
+		if (argc <= 4) ERR_EXIT("bad command\n");
+
+		addr = str_to_size(argv[2]);
+		fn = argv[3];
+		len = strtol(argv[4], NULL, 0);
+		if (addr >> 32) ERR_EXIT("32-bit limit reached\n");
+		write_mem(io, addr & ~1, 0, 0, fn, st->blk_size);
+		if (adfu_exec(io, addr, len)) return 0;
+		return 4;
+
+	} else if (!strcmp(argv[1], "read_mem")) {
+		const char *fn; uint64_t addr, size;
+		if (argc <= 4) ERR_EXIT("bad command\n");
+
+		addr = str_to_size(argv[2]);
+		size = str_to_size(argv[3]);
+		if ((addr | size | (addr + size)) >> 32)
+			ERR_EXIT("32-bit limit reached\n");
+		fn = argv[4];
+		dump_mem(io, addr, size, fn, st->blk_size);
+		return 4;
+
+	} else if (!strcmp(argv[1], "read_mem_lz")) {
+		const char *fn; uint64_t addr, size;
+		if (argc <= 5) ERR_EXIT("bad command\n");
+
+		addr = str_to_size(argv[3]);
+		size = str_to_size(argv[4]);
+		if ((addr | size | (addr + size)) >> 32)
+			ERR_EXIT("32-bit limit reached\n");
+		fn = argv[5];
+		dump_memz(io, argv[2], addr, size, fn, st->blk_size);
+		return 5;
+
+	// the commands below are implemented only in the adfus binary
+	} else if (!strcmp(argv[1], "reset")) {
+		usbc_cmd_t usbc; int len = 0;
+		io->scsi_tag = 0; // important
+		WRITE32_LE(&usbc.sig, USBC_SIG);
+		WRITE32_LE(&usbc.tag, io->scsi_tag);
+		WRITE32_LE(&usbc.data_len, len);
+		usbc.flags = 0;
+		usbc.lun = 0;
+		usbc.cdb_len = 16;
+		memset(usbc.cdb, 0, 16);
+		usbc.cdb[0] = 0xb0;
+		usb_send(io, &usbc, USBC_LEN);
+		if (check_usbs(io, NULL)) return 0;
+		return 1;
+
+	} else if (!strcmp(argv[1], "read_mem2")) {
+		const char *fn; uint64_t addr, size;
+		if (argc <= 4) ERR_EXIT("bad command\n");
+
+		addr = str_to_size(argv[2]);
+		size = str_to_size(argv[3]);
+		if ((addr | size | (addr + size)) >> 32)
+			ERR_EXIT("32-bit limit reached\n");
+		fn = argv[4];
+		dump_mem2(io, addr, size, fn, st->blk_size);
+		return 4;
+
+	// the commands below use payload/nandread.bin
+	} else if (!strcmp(argv[1], "read_brec")) {
+		unsigned brec_idx;
+		nandread_t x;
+		if (argc <= 5) ERR_EXIT("bad command\n");
+
+		brec_idx = strtol(argv[4], NULL, 0);
+		if (brec_idx >> 1)
+			ERR_EXIT("brec_idx must be 0 or 1\n");
+
+		nandread_init(io, &x, argv[2], fn_helper(argv[3]), st->blk_size, st->compress);
+		dump_brec(io, &x, brec_idx, fn_helper(argv[5]));
+		nandread_end(io, &x);
+		return 5;
+
+	} else if (!strcmp(argv[1], "read_nand")) {
+		unsigned start, len;
+		nandread_t x;
+		if (argc <= 5) ERR_EXIT("bad command\n");
+		start = strtol(argv[3], NULL, 0);
+		len = strtol(argv[4], NULL, 0);
+
+		nandread_init(io, &x, argv[2], NULL, st->blk_size, st->compress);
+		dump_nand(io, &x, fn_helper(argv[5]), start, len, 1, st->nand_oob);
+		nandread_end(io, &x);
+		return 5;
+
+	} else if (!strcmp(argv[1], "find_lfi")) {
+		unsigned brec_idx;
+		nandread_t x;
+		if (argc <= 4) ERR_EXIT("bad command\n");
+
+		brec_idx = strtol(argv[3], NULL, 0);
+		if (brec_idx >> 1)
+			ERR_EXIT("brec_idx must be 0 or 1\n");
+
+		nandread_init(io, &x, argv[2], NULL, st->blk_size, st->compress);
+		find_lfi(io, &x, brec_idx, fn_helper(argv[4]));
+		nandread_end(io, &x);
+		return 4;
+
+	// the commands below require loading the correct fwscfNNN.bin
+	} else if (!strcmp(argv[1], "read_lfi")) {
+		const char *fn; uint64_t addr, size;
+		if (argc <= 4) ERR_EXIT("bad command\n");
+
+		addr = str_to_size(argv[2]);
+		size = str_to_size(argv[3]);
+		if ((addr | size) & 0x1ff)
+			ERR_EXIT("must be aligned by 512\n");
+		addr >>= 9; size >>= 9;
+		if (!size) ERR_EXIT("zero size\n");
+		if ((addr | size | (addr + size - 1)) >> 24)
+			ERR_EXIT("24-bit limit reached\n");
+		fn = argv[4];
+		dump_lfi(io, addr, size, fn);
+		return 4;
+
+	} else if (!strcmp(argv[1], "write_flash")) {
+		const char *fn; uint64_t addr, offset, size;
+		if (argc <= 5) ERR_EXIT("bad command\n");
+
+		addr = str_to_size(argv[2]);
+		offset = str_to_size(argv[3]);
+		size = str_to_size(argv[4]);
+		fn = argv[5];
+		if ((addr | size | offset | (addr + size)) >> 32)
+			ERR_EXIT("32-bit limit reached\n");
+		write_flash(io, addr, offset, size, fn);
+		return 5;
+
+	} else if (!strcmp(argv[1], "chip")) {
+		if (argc <= 2) ERR_EXIT("bad command\n");
+		io->chip = atoi(argv[2]);
+		return 2;
+
+	} else if (!strcmp(argv[1], "blk_size")) {
+		int k;
+		if (argc <= 2) ERR_EXIT("bad command\n");
+		st->blk_size = str_to_size(argv[2]);
+		k = io->switched ? BLK_SIZE_MAX : BLK_SIZE_ROM;
+		st->blk_size = st->blk_size < 0 ? 1 :
+				st->blk_size > k ? k : st->blk_size;
+		return 2;
+
+	} else if (!strcmp(argv[1], "nand_oob")) {
+		if (argc <= 2) ERR_EXIT("bad command\n");
+		st->nand_oob = atoi(argv[2]);
+		return 2;
+
+	} else if (!strcmp(argv[1], "compress")) {
+		if (argc <= 2) ERR_EXIT("bad command\n");
+		st->compress = atoi(argv[2]);
+		return 2;
+
+	} else if (!strcmp(argv[1], "timeout")) {
+		if (argc <= 2) ERR_EXIT("bad command\n");
+		io->timeout = atoi(argv[2]);
+		return 2;
+
+	} else {
+		ERR_EXIT("unknown command\n");
+	}
+	return 0;
+}
+
+#define MAX_RETRY 5
+
+// the dumps continue from the journal after a reconnect
+static const char *const retry_cmds[] = {
+	"read_mem", "read_mem_lz", "read_mem2", "read_brec",
+	"read_nand", "find_lfi", "read_lfi", NULL };
+
+/*
+ * These are repeated after the device has gone, to upload the payloads
+ * again. Not the exec commands, a payload may not be safe to run twice.
+ */
+static const char *const setup_cmds[] = {
+	"write_mem", "switch", "simple_switch",
+	"chip", "blk_size", "timeout", NULL };
+
+static int find_cmd(const char *const *list, const char *name) {
+	for (; *list; list++)
+		if (!strcmp(*list, name)) return 1;
+	return 0;
+}
+
+// the input of a command read from a pipe can't be uploaded again
+static int stream_args(int argc, char **argv) {
+	struct stat st;
+	int i, k;
+	for (i = 2; i < argc; i++) {
+		if (!strcmp(argv[i], "-")) return 1;
+		k = fd_arg(argv[i]);
+		if (k >= 0 && (fstat(daemon_fds[k], &st) || !S_ISREG(st.st_mode)))
+			return 1;
+	}
+	return 0;
+}
+
+// returns XFER_* if a transfer failed, or zero with the result in "n"
+static int run_guarded(usbio_t *io, script_t *st, int argc, char **argv, int *n) {
+	jmp_buf jmp; int err;
+
+	if ((err = setjmp(jmp))) {
+		xfer_jmp = NULL;
+		dump_abort();
+		return err;
+	}
+	xfer_jmp = &jmp;
+	*n = run_command(io, st, argc, argv);
+	xfer_jmp = NULL;
+	return 0;
+}
+
+// repeats the setup commands, returns -1 if one of them fails
+static int run_setup(usbio_t *io, script_t *st, int argc, char **argv,
+		const int *setup, int nsetup) {
+	int i, n, err;
+	// the boot ROM runs until the switch is repeated
+	if (st->blk_size > BLK_SIZE_ROM) st->blk_size = BLK_SIZE_ROM;
+	for (i = 0; i < nsetup; i++) {
+		err = run_guarded(io, st, argc - setup[i], argv + setup[i], &n);
+		if (err) return err;
+		if (!n) return -1;
+	}
+	return 0;
+}
+
+// runs the commands, returns non-zero if stopped by a failed command
+static int run_script(usbio_t *io, script_t *st, int argc, char **argv) {
+	char **argv0 = argv;
+	int argc0 = argc, *setup, nsetup = 0;
+	int n, err, retry = 0, streamed = 0;
+
+	if (io->gone) {
+		DBG_LOG("the device has gone\n");
+		return 1;
+	}
+	setup = (int*)malloc(argc * sizeof(int));
+	if (!setup) ERR_EXIT("malloc failed\n");
+	for (; argc > 1; argc -= n, argv += n) {
+		err = run_guarded(io, st, argc, argv, &n);
+		if (!err) {
+			if (!n) break;
+			if (find_cmd(setup_cmds, argv[1])) {
+				if (stream_args(n, argv)) streamed = 1;
+				else setup[nsetup++] = argv - argv0;
+			}
+			retry = dump_retry = 0;
+			continue;
+		}
+		n = 0;
+		while (err) {
+			if (!find_cmd(retry_cmds, argv[1]) || ++retry > MAX_RETRY) break;
+			if (err == XFER_GONE && streamed) {
+				DBG_LOG("can't upload the input from a pipe again\n");
+				break;
+			}
+			DBG_LOG("%s, retry %d\n", err == XFER_GONE ?
+					"waiting for the device" : "resetting the transfer", retry);
+			if (usbio_reconnect(io, err == XFER_GONE)) {
+				DBG_LOG("device not found\n");
+				break;
+			}
+			if (err != XFER_GONE) err = 0;
+			else err = run_setup(io, st, argc0, argv0, setup, nsetup);
+			if (err < 0) break;
+		}
+		if (err) break;
+		dump_retry = 1;
+	}
+	free(setup);
+	return argc > 1;
+}
+
+/*
+ * Daemon mode (Linux only): the device stays open and the commands come
+ * from a UNIX socket (SOCK_SEQPACKET). A request is one packet with the
+ * arguments separated by zeros, the files are passed as descriptors
+ * (SCM_RIGHTS). The log is sent back in packets starting with 'L', then
+ * 'R' and the result. The "exit" request stops the daemon.
+ */
+#ifdef __linux__
+
+#define DAEMON_MSG_LEN 0x10000
+#define DAEMON_FDS 16
+
+static ssize_t daemon_log_write(void *cookie, const char *buf, size_t n) {
+	int conn = *(int*)cookie;
+	char msg[1 + 1024]; size_t i, k;
+	for (i = 0; i < n; i += k) {
+		k = n - i;
+		if (k > sizeof(msg) - 1) k = sizeof(msg) - 1;
+		msg[0] = 'L';
+		memcpy(msg + 1, buf + i, k);
+		if (send(conn, msg, k + 1, MSG_NOSIGNAL) < 0) return -1;
+	}
+	return n;
+}
+
+// returns 0 when the client has gone, -1 to stop the daemon
+static int daemon_request(usbio_t *io, script_t *st, int conn, char *msg) {
+	static const cookie_io_functions_t log_funcs = { NULL, daemon_log_write, NULL, NULL };
+	union { struct cmsghdr h; char buf[CMSG_SPACE(DAEMON_FDS * sizeof(int))]; } ctl;
+	struct iovec iov; struct msghdr mh; struct cmsghdr *cm;
+	int fds[DAEMON_FDS], nfds = 0, argc = 1, i;
+	volatile int ret = 1;
+	char **argv, res[16];
+	ssize_t n;
+	jmp_buf jmp;
+
+	iov.iov_base = msg;
+	iov.iov_len = DAEMON_MSG_LEN;
+	memset(&mh, 0, sizeof(mh));
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+	mh.msg_control = ctl.buf;
+	mh.msg_controllen = sizeof(ctl.buf);
+	n = recvmsg(conn, &mh, MSG_CMSG_CLOEXEC);
+	if (n <= 0) return 0;
+	for (cm = CMSG_FIRSTHDR(&mh); cm; cm = CMSG_NXTHDR(&mh, cm)) {
+		if (cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SCM_RIGHTS) continue;
+		i = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		memcpy(fds + nfds, CMSG_DATA(cm), i * sizeof(int));
+		nfds += i;
+	}
+	msg[n] = 0;
+	if (!strcmp(msg, "exit")) {
+		for (i = 0; i < nfds; i++) close(fds[i]);
+		send(conn, "R0", 2, MSG_NOSIGNAL);
+		return -1;
+	}
+
+	argv = (char**)malloc((n + 2) * sizeof(char*));
+	if (!argv) ERR_EXIT("malloc failed\n");
+	argv[0] = (char*)"actions_dump";
+	for (i = 0; i < n; i += strlen(msg + i) + 1) argv[argc++] = msg + i;
+	argv[argc] = NULL;
+
+	log_file = fopencookie(&conn, "w", log_funcs);
+	if (log_file) setvbuf(log_file, NULL, _IOLBF, 0);
+	daemon_fds = fds;
+	daemon_nfds = nfds;
+	if (mh.msg_flags & (MSG_TRUNC | MSG_CTRUNC))
+		DBG_LOG("request too long\n");
+	else if (!setjmp(jmp)) {
+		err_jmp = &jmp;
+		ret = run_script(io, st, argc, argv);
+	} else {
+		xfer_jmp = NULL;
+		dump_abort();
+	}
+	err_jmp = NULL;
+	daemon_fds = NULL;
+	if (log_file) fclose(log_file);
+	log_file = NULL;
+	for (i = 0; i < nfds; i++) close(fds[i]);
+	free(argv);
+
+	n = sprintf(res, "R%d", ret);
+	return send(conn, res, n, MSG_NOSIGNAL) == n;
+}
+
+static void run_daemon(usbio_t *io, script_t *st, const char *path) {
+	struct sockaddr_un addr; struct stat sb;
+	int sock, conn, ret = 0;
+	char *msg;
+
+	if (strlen(path) >= sizeof(addr.sun_path))
+		ERR_EXIT("socket path too long\n");
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (sock < 0) ERR_EXIT("socket failed\n");
+	// a socket left by a previous daemon, not any other file
+	if (!lstat(path, &sb) && S_ISSOCK(sb.st_mode)) unlink(path);
+	if (bind(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(sock, 4) < 0)
+		ERR_EXIT("bind(\"%s\") failed\n", path);
+	// for the user and the group of the daemon
+	if (chmod(path, 0660)) ERR_EXIT("chmod(\"%s\") failed\n", path);
+	msg = (char*)malloc(DAEMON_MSG_LEN + 1);
+	if (!msg) ERR_EXIT("malloc failed\n");
+	DBG_LOG("daemon: listening on %s\n", path);
+
+	while (ret >= 0) {
+		conn = accept4(sock, NULL, NULL, SOCK_CLOEXEC);
+		if (conn < 0) {
+			if (errno == EINTR || errno == ECONNABORTED) continue;
+			// out of descriptors or memory, wait for them
+			if (errno == EMFILE || errno == ENFILE ||
+					errno == ENOBUFS || errno == ENOMEM) {
+				usleep(100000);
+				continue;
+			}
+			DBG_LOG("accept failed\n");
+			break;
+		}
+		while ((ret = daemon_request(io, st, conn, msg)) > 0 && !io->gone);
+		close(conn);
+		// nothing to serve without the device
+		if (io->gone) {
+			DBG_LOG("daemon: the device has gone\n");
+			break;
+		}
+	}
+	free(msg);
+	close(sock);
+	unlink(path);
+}
+
+// sends the commands to the daemon, "@file" arguments are passed as descriptors
+static int run_client(const char *path, int argc, char **argv) {
+	struct sockaddr_un addr;
+	union { struct cmsghdr h; char buf[CMSG_SPACE(DAEMON_FDS * sizeof(int))]; } ctl;
+	struct iovec iov; struct msghdr mh;
+	int sock, fds[DAEMON_FDS], nfds = 0, i, ret = 1;
+	char *msg; size_t n = 0, len;
+
+	if (strlen(path) >= sizeof(addr.sun_path))
+		ERR_EXIT("socket path too long\n");
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (sock < 0) ERR_EXIT("socket failed\n");
+	if (connect(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0)
+		ERR_EXIT("connect(\"%s\") failed\n", path);
+
+	msg = (char*)malloc(DAEMON_MSG_LEN + 1);
+	if (!msg) ERR_EXIT("malloc failed\n");
+	for (i = 1; i < argc; i++) {
+		const char *arg = argv[i];
+		char buf[16];
+		if (arg[0] == '@') {
+			if (nfds == DAEMON_FDS) ERR_EXIT("too many files\n");
+			fds[nfds] = open(arg + 1, O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+			// an input file may be read-only
+			if (fds[nfds] < 0 && errno == EACCES)
+				fds[nfds] = open(arg + 1, O_RDONLY | O_CLOEXEC);
+			if (fds[nfds] < 0) ERR_EXIT("open(\"%s\") failed\n", arg + 1);
+			sprintf(buf, "@%d", nfds++);
+			arg = buf;
+		}
+		len = strlen(arg) + 1;
+		if (n + len > DAEMON_MSG_LEN) ERR_EXIT("request too long\n");
+		memcpy(msg + n, arg, len);
+		n += len;
+	}
+	if (!n) ERR_EXIT("no commands\n");
+
+	iov.iov_base = msg;
+	iov.iov_len = n;
+	memset(&mh, 0, sizeof(mh));
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+	if (nfds) {
+		struct cmsghdr *cm;
+		mh.msg_control = ctl.buf;
+		mh.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+		cm = CMSG_FIRSTHDR(&mh);
+		cm->cmsg_level = SOL_SOCKET;
+		cm->cmsg_type = SCM_RIGHTS;
+		cm->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+		memcpy(CMSG_DATA(cm), fds, nfds * sizeof(int));
+	}
+	if (sendmsg(sock, &mh, MSG_NOSIGNAL) < 0)
+		ERR_EXIT("sendmsg failed\n");
+	for (i = 0; i < nfds; i++) close(fds[i]);
+
+	for (;;) {
+		ssize_t k = recv(sock, msg, DAEMON_MSG_LEN, 0);
+		if (k <= 0) {
+			DBG_LOG("connection closed\n");
+			break;
+		}
+		if (msg[0] == 'L') fwrite(msg + 1, 1, k - 1, stderr);
+		else if (msg[0] == 'R') {
+			msg[k] = 0;
+			ret = atoi(msg + 1);
+			break;
+		}
+	}
+	free(msg);
+	close(sock);
+	return ret;
+}
+#endif
+
 #if USE_LIBUSB
+#define MAX_DEVICES 32
+
+static void usb_dev_path(libusb_device *dev, char *buf) {
+	uint8_t ports[7];
+	int i, n = libusb_get_port_numbers(dev, ports, 7);
+	buf += sprintf(buf, "%u", libusb_get_bus_number(dev));
+	for (i = 0; i < n; i++)
+		buf += sprintf(buf, "%c%u", i ? '.' : '-', ports[i]);
+}
+
+/*
+ * Opens up to "max" matching devices, or only the device
+ * at the specified path. Returns the number of opened devices.
+ */
+static int usb_open_devices(int id_vendor, int id_product, const char *path,
+		libusb_device_handle **handles, char (*paths)[USB_PATH_LEN], int max) {
+	libusb_device **list;
+	ssize_t i, n = libusb_get_device_list(NULL, &list);
+	int err, k = 0;
+
+	if (n < 0) ERR_EXIT("libusb_get_device_list failed : %s\n", libusb_error_name(n));
+	for (i = 0; i < n && k < max; i++) {
+		struct libusb_device_descriptor desc;
+		char buf[USB_PATH_LEN];
+		if (libusb_get_device_descriptor(list[i], &desc) < 0) continue;
+		if (desc.idVendor != id_vendor || desc.idProduct != id_product) continue;
+		usb_dev_path(list[i], buf);
+		if (path && strcmp(path, buf)) continue;
+		err = libusb_open(list[i], &handles[k]);
+		if (err < 0) {
+			DBG_LOG("libusb_open(%s) failed : %s\n", buf, libusb_error_name(err));
+			continue;
+		}
+		strcpy(paths[k++], buf);
+	}
+	libusb_free_device_list(list, 1);
+	return k;
+}
+
+static int LIBUSB_CALL usb_hotplug_cb(libusb_context *ctx,
+		libusb_device *dev, libusb_hotplug_event event, void *arg) {
+	(void)ctx; (void)dev; (void)event;
+	*(int*)arg = 1;
+	return 0;
+}
+
+typedef struct {
+	pthread_t thread;
 	libusb_device_handle *device;
+	char path[USB_PATH_LEN];
+	int id_vendor, id_product;
+	int argc, verbose, ret;
+	char **argv;
+} worker_t;
+
+// runs the script for one of several devices
+static void* worker_main(void *arg) {
+	worker_t *w = (worker_t*)arg;
+	char name[USB_PATH_LEN + 8];
+	usbio_t *volatile io = NULL;
+	script_t st = { 0x200, 0, 0 };
+	jmp_buf jmp;
+
+	sprintf(name, "%s.log", w->path);
+	log_file = fopen(name, "w");
+	if (log_file) setvbuf(log_file, NULL, _IOLBF, 0);
+	sprintf(name, "%s_", w->path);
+	out_prefix = name;
+	trace_thread(w->path);
+
+	w->ret = 1;
+	if (!setjmp(jmp)) {
+		err_jmp = &jmp;
+		io = usbio_init(w->device, 0);
+		io->verbose = w->verbose;
+		io->id_vendor = w->id_vendor;
+		io->id_product = w->id_product;
+		strcpy(io->path, w->path);
+		w->ret = run_script(io, &st, w->argc, w->argv);
+	} else {
+		xfer_jmp = NULL;
+		dump_abort();
+	}
+	err_jmp = NULL;
+	if (io) usbio_free(io);
+	else libusb_close(w->device);
+	if (log_file) fclose(log_file);
+	log_file = NULL;
+	return NULL;
+}
+
+static int run_all(libusb_device_handle **handles,
+		char (*paths)[USB_PATH_LEN], int n, int id_vendor, int id_product,
+		int verbose, int argc, char **argv) {
+	worker_t *workers = (worker_t*)calloc(n, sizeof(worker_t));
+	int i, ret = 0;
+
+	if (!workers) ERR_EXIT("malloc failed\n");
+	for (i = 0; i < n; i++) {
+		worker_t *w = workers + i;
+		w->device = handles[i];
+		strcpy(w->path, paths[i]);
+		w->id_vendor = id_vendor;
+		w->id_product = id_product;
+		w->argc = argc; w->argv = argv;
+		w->verbose = verbose;
+		if (pthread_create(&w->thread, NULL, worker_main, w))
+			ERR_EXIT("pthread_create failed\n");
+		DBG_LOG("%s: started\n", w->path);
+	}
+	for (i = 0; i < n; i++) {
+		worker_t *w = workers + i;
+		pthread_join(w->thread, NULL);
+		DBG_LOG("%s: %s\n", w->path, w->ret ? "failed" : "done");
+		ret |= w->ret;
+	}
+	free(workers);
+	return ret;
+}
+#endif
+
+#if !USE_LIBUSB
+// kernel uevents, to know when a tty is added
+static int uevent_open(void) {
+	struct sockaddr_nl addr;
+	int fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, NETLINK_KOBJECT_UEVENT);
+	if (fd < 0) return -1;
+	memset(&addr, 0, sizeof(addr));
+	addr.nl_family = AF_NETLINK;
+	addr.nl_groups = 1;
+	if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+// returns 1 if a tty was added
+static int uevent_wait(int fd, int ms) {
+	char buf[2048];
+	struct pollfd fds = { 0 };
+	int i, n;
+
+	fds.fd = fd;
+	fds.events = POLLIN;
+	if (poll(&fds, 1, ms) <= 0) return 0;
+	n = recv(fd, buf, sizeof(buf) - 1, 0);
+	if (n <= 0) return 0;
+	buf[n] = 0;
+	// "add@/devices/...", then "KEY=VALUE" strings
+	if (strncmp(buf, "add@", 4)) return 0;
+	for (i = 0; i < n; i += strlen(buf + i) + 1)
+		if (!strcmp(buf + i, "SUBSYSTEM=tty")) return 1;
+	return 0;
+}
+#endif
+
+int main(int argc, char **argv) {
+#if USE_LIBUSB
+	libusb_device_handle *devices[MAX_DEVICES];
+	char paths[MAX_DEVICES][USB_PATH_LEN];
+	const char *path = NULL; int all = 0, n = 0;
+	libusb_hotplug_callback_handle hotplug;
+	int arrived = 0, event_fd = -1;
 #else
-	int serial;
+	int serial, event_fd;
 #endif
-	usbio_t *io; int ret, i;
+	usbio_t *io; int ret, i, fast = 0;
+	script_t st = { 0x200, 0, 0 };
+	const char *daemon_path = NULL, *connect_path = NULL;
+	uint64_t time;
 	int wait = 300 * REOPEN_FREQ;
 	const char *tty = "/dev/ttyUSB0";
 	int verbose = 0;
 	// flashdisk = 10d6:1101, ADFU mode = 10d6:10d6
 	int id_vendor = 0x10d6, id_product = 0x10d6;
-	int blk_size = 0x200;
 
 #if USE_LIBUSB
 	ret = libusb_init(NULL);
@@ -1004,10 +4069,60 @@ int main(int argc, char **argv) {
 			id_product = strtol(argv[2] + 5, &end, 16);
 			if (end != argv[2] + 9) ERR_EXIT("bad option\n");
 			argc -= 2; argv += 2;
+#if USE_LIBUSB
+		} else if (!strcmp(argv[1], "--path")) {
+			if (argc <= 2) ERR_EXIT("bad option\n");
+			path = argv[2];
+			argc -= 2; argv += 2;
+		} else if (!strcmp(argv[1], "--all")) {
+			all = 1;
+			argc -= 1; argv += 1;
+#endif
+		} else if (!strcmp(argv[1], "--daemon")) {
+			if (argc <= 2) ERR_EXIT("bad option\n");
+			daemon_path = argv[2];
+			argc -= 2; argv += 2;
+		} else if (!strcmp(argv[1], "--connect")) {
+			if (argc <= 2) ERR_EXIT("bad option\n");
+			connect_path = argv[2];
+			argc -= 2; argv += 2;
+		} else if (!strcmp(argv[1], "--resume")) {
+			dump_resume = 1;
+			argc -= 1; argv += 1;
+		} else if (!strcmp(argv[1], "--sparse")) {
+			if (argc <= 2) ERR_EXIT("bad option\n");
+			dump_sparse = strtol(argv[2], NULL, 0);
+			if (dump_sparse && dump_sparse != 0xff) ERR_EXIT("bad option\n");
+			argc -= 2; argv += 2;
+		} else if (!strcmp(argv[1], "--direct")) {
+			dump_direct = 1;
+			argc -= 1; argv += 1;
+		} else if (!strcmp(argv[1], "--verify")) {
+			write_verify = 1;
+			argc -= 1; argv += 1;
+		} else if (!strcmp(argv[1], "--diff")) {
+			write_diff = 1;
+			argc -= 1; argv += 1;
 		} else if (!strcmp(argv[1], "--wait")) {
 			if (argc <= 2) ERR_EXIT("bad option\n");
 			wait = atoi(argv[2]) * REOPEN_FREQ;
 			argc -= 2; argv += 2;
+		} else if (!strcmp(argv[1], "--stats")) {
+			stats_enable = 1;
+			argc -= 1; argv += 1;
+		} else if (!strcmp(argv[1], "--stats-json")) {
+			if (argc <= 2) ERR_EXIT("bad option\n");
+			stats_enable = 1;
+			stats_json = argv[2];
+			argc -= 2; argv += 2;
+		} else if (!strcmp(argv[1], "--pcap")) {
+			if (argc <= 2) ERR_EXIT("bad option\n");
+			if (!pcap) pcap_start(argv[2]);
+			argc -= 2; argv += 2;
+		} else if (!strcmp(argv[1], "--trace")) {
+			if (argc <= 2) ERR_EXIT("bad option\n");
+			if (!trace_buf) trace_init(argv[2]);
+			argc -= 2; argv += 2;
 		} else if (!strcmp(argv[1], "--verbose")) {
 			if (argc <= 2) ERR_EXIT("bad option\n");
 			verbose = atoi(argv[2]);
@@ -1017,323 +4132,92 @@ int main(int argc, char **argv) {
 		} else break;
 	}
 
+#ifndef __linux__
+	if (connect_path || daemon_path)
+		ERR_EXIT("the daemon mode is only supported on Linux\n");
+#else
+	if (connect_path) {
+		ret = run_client(connect_path, argc, argv);
+#if USE_LIBUSB
+		libusb_exit(NULL);
+#endif
+		return ret;
+	}
+#endif
+#if USE_LIBUSB
+	if (all && daemon_path) ERR_EXIT("--daemon can't be used with --all\n");
+#endif
+
+	// wait for the device to be added instead of polling if possible
+#if USE_LIBUSB
+	if (libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG) &&
+			!libusb_hotplug_register_callback(NULL,
+			LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED, 0, id_vendor, id_product,
+			LIBUSB_HOTPLUG_MATCH_ANY, usb_hotplug_cb, &arrived, &hotplug))
+		event_fd = 0;
+#else
+	event_fd = uevent_open();
+#endif
+	time = get_time_usec();
 	for (i = 0; ; i++) {
 #if USE_LIBUSB
-		device = libusb_open_device_with_vid_pid(NULL, id_vendor, id_product);
-		if (device) break;
-		if (i >= wait)
+		n = usb_open_devices(id_vendor, id_product, path,
+				devices, paths, all ? MAX_DEVICES : 1);
+		if (n) break;
+		if (get_time_usec() - time >= (uint64_t)wait * (1000000 / REOPEN_FREQ))
 			ERR_EXIT("libusb_open_device failed\n");
 #else
 		serial = open(tty, O_RDWR | O_NOCTTY | O_SYNC);
 		if (serial >= 0) break;
-		if (i >= wait)
+		if (get_time_usec() - time >= (uint64_t)wait * (1000000 / REOPEN_FREQ))
 			ERR_EXIT("open(ttyUSB) failed\n");
 #endif
 		if (!i) DBG_LOG("Waiting for connection (%ds)\n", wait / REOPEN_FREQ);
-		usleep(1000000 / REOPEN_FREQ);
+		if (event_fd < 0) {
+			usleep(1000000 / REOPEN_FREQ);
+			continue;
+		}
+		// retry every 1ms for a while after an event, the device node
+		// or its permissions may not be ready yet
+#if USE_LIBUSB
+		{
+			struct timeval tv = { 0, fast ? 1000 : 100000 };
+			arrived = 0;
+			libusb_handle_events_timeout_completed(NULL, &tv, &arrived);
+			if (arrived) fast = 100;
+			else if (fast) fast--;
+		}
+#else
+		if (uevent_wait(event_fd, fast ? 1 : 100)) fast = 100;
+		else if (fast) fast--;
+#endif
 	}
+#if USE_LIBUSB
+	if (!event_fd) libusb_hotplug_deregister_callback(NULL, hotplug);
+#else
+	if (event_fd >= 0) close(event_fd);
+#endif
 
 #if USE_LIBUSB
-	io = usbio_init(device, 0);
+	if (all) {
+		ret = run_all(devices, paths, n, id_vendor, id_product,
+				verbose, argc, argv);
+		libusb_exit(NULL);
+		return ret;
+	}
+	io = usbio_init(devices[0], 0);
+	io->id_vendor = id_vendor;
+	io->id_product = id_product;
+	strcpy(io->path, paths[0]);
 #else
 	io = usbio_init(serial, 0);
+	io->tty = tty;
 #endif
 	io->verbose = verbose;
-
-	while (argc > 1) {
-		
-		if (!strcmp(argv[1], "verbose")) {
-			if (argc <= 2) ERR_EXIT("bad command\n");
-			io->verbose = atoi(argv[2]);
-			argc -= 2; argv += 2;
-
-		} else if (!strcmp(argv[1], "inquiry")) {
-			usbc_cmd_t usbc; int len = 0x24;
-			WRITE32_LE(&usbc.sig, USBC_SIG);
-			WRITE32_LE(&usbc.tag, scsi_tag);
-			WRITE32_LE(&usbc.data_len, len);
-			usbc.flags = 0x80;
-			usbc.lun = 0;
-			usbc.cdb_len = 6;
-			memset(usbc.cdb, 0, 16);
-			usbc.cdb[0] = CMD_INQUIRY;
-			WRITE16_BE(usbc.cdb + 3, len);
-			usb_send(io, &usbc, USBC_LEN);
-
-			if (usb_recv(io, len) != len) {
-				DBG_LOG("unexpected response\n");
-				break;
-			}
-			if (io->verbose < 2) {
-				DBG_LOG("result (%d):\n", len);
-				print_mem(stderr, io->buf, len);
-			}
-			if (check_usbs(io, NULL)) break;
-			argc -= 1; argv += 1;
-
-		} else if (!strcmp(argv[1], "adfu_reboot")) {
-			usbc_cmd_t usbc; int len = 11;
-			WRITE32_LE(&usbc.sig, USBC_SIG);
-			WRITE32_LE(&usbc.tag, scsi_tag);
-			WRITE32_LE(&usbc.data_len, len);
-			usbc.flags = 0x80;
-			usbc.lun = 0;
-			usbc.cdb_len = 16;
-			memset(usbc.cdb, 0, 16);
-			usbc.cdb[0] = 0xcc;
-			usbc.cdb[7] = len;
-			usb_send(io, &usbc, USBC_LEN);
-			if (usb_recv(io, len) != len ||
-			  	memcmp(io->buf, "ACTIONSUSBD", len)) {
-				DBG_LOG("unexpected response\n");
-				break;
-			}
-			if (check_usbs(io, NULL)) break;
-
-			len = 2;
-			WRITE32_LE(&usbc.tag, scsi_tag);
-			WRITE32_LE(&usbc.data_len, len);
-			usbc.cdb[0] = 0xcb;
-			usbc.cdb[1] = 0x21;
-			usbc.cdb[7] = len;
-			usb_send(io, &usbc, USBC_LEN);
-			if (usb_recv(io, len) != len ||
-					io->buf[0] != 0xff || io->buf[1]) {
-				DBG_LOG("unexpected response\n");
-				break;
-			}
-			if (check_usbs(io, NULL)) break;
-			argc -= 1; argv += 1;
-
-		} else if (!strcmp(argv[1], "adfu_info")) {
-			usbc_cmd_t usbc; int len = 0x12;
-			scsi_tag = 0; // important
-			WRITE32_LE(&usbc.sig, USBC_SIG);
-			WRITE32_LE(&usbc.tag, scsi_tag);
-			WRITE32_LE(&usbc.data_len, len);
-			usbc.flags = 0x80;
-			usbc.lun = 0;
-			usbc.cdb_len = 16;
-			memset(usbc.cdb, 0, 16);
-			usbc.cdb[0] = 0xcc;
-			// ATJ2127 return 0x12 bytes
-			// ATJ2157 return the specified amount
-			usbc.cdb[7] = len;
-			usb_send(io, &usbc, USBC_LEN);
-
-			if (usb_recv(io, len) != len) {
-				DBG_LOG("unexpected response\n");
-				break;
-			}
-			// "\0CADFUD" ...
-			// ATJ2127: "\x10\xd6"
-			// ATJ2157: "\x30\x51"
-			// ... "A\0\0\0\0\0\0\0\0"
-			if (!memcmp(io->buf, "\0CADFUD", 7)) {
-				int id = io->buf[7] << 8 | io->buf[8];
-				const char *s = NULL;
-				switch (id) {
-				case 0x10d6: s = "ATJ2127"; break;
-				case 0x3051: s = "ATJ2157"; break;
-				}
-				if (s) DBG_LOG("guess: chip = %s\n", s);
-			}
-			if (io->verbose < 2) {
-				DBG_LOG("result (%d):\n", len);
-				print_mem(stderr, io->buf, len);
-			}
-			if (check_usbs(io, NULL)) break;
-			argc -= 1; argv += 1;
-
-		} else if (!strcmp(argv[1], "write_mem")) {
-			const char *fn; uint64_t addr, offset, size;
-			if (argc <= 5) ERR_EXIT("bad command\n");
-
-			addr = str_to_size(argv[2]);
-			offset = str_to_size(argv[3]);
-			size = str_to_size(argv[4]);
-			fn = argv[5];
-			if ((addr | size | offset | (addr + size)) >> 32)
-				ERR_EXIT("32-bit limit reached\n");
-			write_mem(io, addr, offset, size, fn, blk_size);
-			argc -= 5; argv += 5;
-
-		} else if (!strcmp(argv[1], "switch")) {
-			uint64_t addr;
-			if (argc <= 2) ERR_EXIT("bad command\n");
-
-			addr = str_to_size(argv[2]);
-			if (addr >> 32) ERR_EXIT("32-bit limit reached\n");
-			adfu_switch(io, addr);
-			blk_size = 0x4000;
-			argc -= 2; argv += 2;
-
-		} else if (!strcmp(argv[1], "simple_switch")) {
-			const char *fn; uint64_t addr;
-			if (argc <= 3) ERR_EXIT("bad command\n");
-
-			addr = str_to_size(argv[2]);
-			fn = argv[3];
-			if (addr >> 32) ERR_EXIT("32-bit limit reached\n");
-			write_mem(io, addr & ~1, 0, 0, fn, blk_size);
-			adfu_switch(io, addr);
-			blk_size = 0x4000;
-			argc -= 3; argv += 3;
-
-		} else if (!strcmp(argv[1], "exec_ret")) {
-			uint64_t addr; int len;
-			if (argc <= 3) ERR_EXIT("bad command\n");
-
-			addr = str_to_size(argv[2]);
-			len = strtol(argv[3], NULL, 0);
-			if (addr >> 32) ERR_EXIT("32-bit limit reached\n");
-			if (adfu_exec(io, addr, len)) break;
-			argc -= 3; argv += 3;
-
-		} else if (!strcmp(argv[1], "simple_exec")) {
-			const char *fn; uint64_t addr; int len;
-			if (argc <= 4) ERR_EXIT("bad command\n");
-
-			addr = str_to_size(argv[2]);
-			fn = argv[3];
-			len = strtol(argv[4], NULL, 0);
-			if (addr >> 32) ERR_EXIT("32-bit limit reached\n");
-			write_mem(io, addr & ~1, 0, 0, fn, blk_size);
-			if (adfu_exec(io, addr, len)) break;
-			argc -= 4; argv += 4;
-
-		} else if (!strcmp(argv[1], "read_mem")) {
-			const char *fn; uint64_t addr, size;
-			if (argc <= 4) ERR_EXIT("bad command\n");
-
-			addr = str_to_size(argv[2]);
-			size = str_to_size(argv[3]);
-			if ((addr | size | (addr + size)) >> 32)
-				ERR_EXIT("32-bit limit reached\n");
-			fn = argv[4];
-			dump_mem(io, addr, size, fn, blk_size);
-			argc -= 4; argv += 4;
-
-		// the commands below are implemented only in the adfus binary
-		} else if (!strcmp(argv[1], "reset")) {
-			usbc_cmd_t usbc; int len = 0;
-			scsi_tag = 0; // important
-			WRITE32_LE(&usbc.sig, USBC_SIG);
-			WRITE32_LE(&usbc.tag, scsi_tag);
-			WRITE32_LE(&usbc.data_len, len);
-			usbc.flags = 0;
-			usbc.lun = 0;
-			usbc.cdb_len = 16;
-			memset(usbc.cdb, 0, 16);
-			usbc.cdb[0] = 0xb0;
-			usb_send(io, &usbc, USBC_LEN);
-			if (check_usbs(io, NULL)) break;
-			argc -= 1; argv += 1;
-
-		} else if (!strcmp(argv[1], "read_mem2")) {
-			const char *fn; uint64_t addr, size;
-			if (argc <= 4) ERR_EXIT("bad command\n");
-
-			addr = str_to_size(argv[2]);
-			size = str_to_size(argv[3]);
-			if ((addr | size | (addr + size)) >> 32)
-				ERR_EXIT("32-bit limit reached\n");
-			fn = argv[4];
-			dump_mem2(io, addr, size, fn, blk_size);
-			argc -= 4; argv += 4;
-
-		// the commands below use payload/nandread.bin
-		} else if (!strcmp(argv[1], "read_brec")) {
-			unsigned brec_idx;
-			nandread_t x;
-			if (argc <= 5) ERR_EXIT("bad command\n");
-
-			brec_idx = strtol(argv[4], NULL, 0);
-			if (brec_idx >> 1)
-				ERR_EXIT("brec_idx must be 0 or 1\n");
-
-			nandread_init(io, &x, argv[2], fn_helper(argv[3]), blk_size);
-			dump_brec(io, &x, brec_idx, fn_helper(argv[5]));
-			nandread_end(io, &x);
-			argc -= 5; argv += 5;
-
-		} else if (!strcmp(argv[1], "read_nand")) {
-			unsigned start, len;
-			nandread_t x;
-			if (argc <= 5) ERR_EXIT("bad command\n");
-			start = strtol(argv[3], NULL, 0);
-			len = strtol(argv[4], NULL, 0);
-
-			nandread_init(io, &x, argv[2], NULL, blk_size);
-			dump_nand(io, &x, fn_helper(argv[5]), start, len, 1);
-			nandread_end(io, &x);
-			argc -= 5; argv += 5;
-
-		} else if (!strcmp(argv[1], "find_lfi")) {
-			unsigned brec_idx;
-			nandread_t x;
-			if (argc <= 4) ERR_EXIT("bad command\n");
-
-			brec_idx = strtol(argv[3], NULL, 0);
-			if (brec_idx >> 1)
-				ERR_EXIT("brec_idx must be 0 or 1\n");
-
-			nandread_init(io, &x, argv[2], NULL, blk_size);
-			find_lfi(io, &x, brec_idx, fn_helper(argv[4]));
-			nandread_end(io, &x);
-			argc -= 4; argv += 4;
-
-		// the commands below require loading the correct fwscfNNN.bin
-		} else if (!strcmp(argv[1], "read_lfi")) {
-			const char *fn; uint64_t addr, size;
-			if (argc <= 4) ERR_EXIT("bad command\n");
-
-			addr = str_to_size(argv[2]);
-			size = str_to_size(argv[3]);
-			if ((addr | size) & 0x1ff)
-				ERR_EXIT("must be aligned by 512\n");
-			addr >>= 9; size >>= 9;
-			if (!size) ERR_EXIT("zero size\n");
-			if ((addr | size | (addr + size - 1)) >> 24)
-				ERR_EXIT("24-bit limit reached\n");
-			fn = argv[4];
-			dump_lfi(io, addr, size, fn, blk_size);
-			argc -= 4; argv += 4;
-
-		} else if (!strcmp(argv[1], "write_flash")) {
-			const char *fn; uint64_t addr, offset, size;
-			if (argc <= 5) ERR_EXIT("bad command\n");
-
-			addr = str_to_size(argv[2]);
-			offset = str_to_size(argv[3]);
-			size = str_to_size(argv[4]);
-			fn = argv[5];
-			if ((addr | size | offset | (addr + size)) >> 32)
-				ERR_EXIT("32-bit limit reached\n");
-			write_flash(io, addr, offset, size, fn, blk_size);
-			argc -= 5; argv += 5;
-
-		} else if (!strcmp(argv[1], "chip")) {
-			if (argc <= 2) ERR_EXIT("bad command\n");
-			adfu_chip = atoi(argv[2]);
-			argc -= 2; argv += 2;
-
-		} else if (!strcmp(argv[1], "blk_size")) {
-			if (argc <= 2) ERR_EXIT("bad command\n");
-			blk_size = str_to_size(argv[2]);
-			blk_size = blk_size < 0 ? 1 :
-					blk_size > 0x4000 ? 0x4000 : blk_size;
-			argc -= 2; argv += 2;
-
-		} else if (!strcmp(argv[1], "timeout")) {
-			if (argc <= 2) ERR_EXIT("bad command\n");
-			io->timeout = atoi(argv[2]);
-			argc -= 2; argv += 2;
-
-		} else {
-			ERR_EXIT("unknown command\n");
-		}
-	}
+	ret = run_script(io, &st, argc, argv);
+#ifdef __linux__
+	if (daemon_path && !ret) run_daemon(io, &st, daemon_path);
+#endif
 
 	usbio_free(io);
 #if USE_LIBUSB
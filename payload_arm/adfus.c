@@ -24,6 +24,7 @@ static struct { void *addr; unsigned size; } *exec_result;
 static uint8_t blk_size;
 static volatile uint8_t fwsc_flag;
 static volatile uint8_t switch_loop;
+// 1 = switch, 2 = job started, 3 = job done
 static volatile uint8_t switch_flag;
 static char usbs_error;
 
@@ -42,6 +43,7 @@ static void error_vec(void) {
 }
 
 static void int_main(void);
+static void cmd_exec(uint32_t addr);
 
 void entry_main(void) {
 	wd_clear();
@@ -69,6 +71,10 @@ void entry_main(void) {
 		if (switch_flag == 1) {
 			((void (*)(void))switch_addr)();
 			switch_flag = 0;
+		} else if (switch_flag == 2) {
+			// USB commands are served meanwhile
+			cmd_exec(switch_addr);
+			switch_flag = 3;
 		}
 	} while (switch_loop != 0x77);
 
@@ -104,16 +110,21 @@ static void usb_wait(int a1) {
 	wd_clear();
 }
 
+// len <= 0x10000
+static void usb_start(void *p, int a1, unsigned len, int a3) {
+	USB_REG(0x308 + a1 * 8) = len << 8 | a3 << 1;
+	USB_REG(0x30c + a1 * 8) = (uint32_t)p;
+	USB_REG(0x330) = 1;
+	USB_REG(0x308 + a1 * 8) |= 1;
+}
+
 static int usb_send_recv(void *p0, int a1, unsigned len, int a3) {
 	unsigned n; char *p = p0;
 	while (len) {
 		n = len;
 		if (n > 0x10000) n = 0x10000;
 		len -= n;
-		USB_REG(0x308 + a1 * 8) = n << 8 | a3 << 1;
-		USB_REG(0x30c + a1 * 8) = (uint32_t)p; p += n;
-		USB_REG(0x330) = 1;
-		USB_REG(0x308 + a1 * 8) |= 1;
+		usb_start(p, a1, n, a3); p += n;
 		usb_wait(a1);
 	}
 	return 0;
@@ -121,6 +132,10 @@ static int usb_send_recv(void *p0, int a1, unsigned len, int a3) {
 
 #define usb_send_buf(addr, len) usb_send_recv(addr, 0, len, 1)
 #define usb_recv_buf(addr, len) usb_send_recv(addr, 2, len, 0)
+#define usb_send_start(addr, len) usb_start(addr, 0, len, 1)
+#define usb_send_wait() usb_wait(0)
+#define usb_recv_start(addr, len) usb_start(addr, 2, len, 0)
+#define usb_recv_wait() usb_wait(2)
 
 static void ret_usbs(void) {
 	usb_buf[3] = USBS_SIG >> 24;
@@ -135,22 +150,224 @@ static void ret_usbs(void) {
 DEF_CONST_FN(0x11e400, void, flash_fn, (int type, uint32_t sector, uint32_t len, void *buf))
 
 static void cmd_flash(uint32_t cmd, uint32_t addr, uint32_t len) {
-	uint32_t n;
-	void *buf_addr = (void*)0x11a000;
+	uint32_t n, next, i, half = blk_size;
+	// two blocks of free RAM, the 16K buffer holds just one
+	uint8_t *buf_addr = (uint8_t*)0x120000;
 
+	n = len > half ? half : len;
+	if (cmd == 0x80) {
+		// read to one block while the other is sent
+		if (n) flash_fn(cmd, addr, n, buf_addr);
+		for (i = 0; len; addr += n, len -= n, n = next, i ^= 0x4000) {
+			usb_send_start(buf_addr + i, n << 9);
+			next = len - n;
+			if (next > half) next = half;
+			if (next) flash_fn(cmd, addr + n, next, buf_addr + (i ^ 0x4000));
+			usb_send_wait();
+		}
+		return;
+	}
 	if (cmd == 0xff) flash_fn(cmd, 0, 0, 0);
+	// receive to one block while the other is written
+	if (n) usb_recv_start(buf_addr, n << 9);
+	for (i = 0; len; addr += n, len -= n, n = next, i ^= 0x4000) {
+		usb_recv_wait();
+		next = len - n;
+		if (next > half) next = half;
+		if (next) usb_recv_start(buf_addr + (i ^ 0x4000), next << 9);
+		if (cmd != 0xff)
+			flash_fn(cmd, addr, n, buf_addr + i);
+	}
+}
+
+static uint32_t crc32_update(uint32_t crc, const uint8_t *p, uint32_t n) {
+	static const uint32_t tab[16] = {
+		0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac,
+		0x76dc4190, 0x6b6b51f4, 0x4db26158, 0x5005713c,
+		0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c,
+		0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c };
+	crc = ~crc;
+	while (n--) {
+		crc ^= *p++;
+		crc = crc >> 4 ^ tab[crc & 15];
+		crc = crc >> 4 ^ tab[crc & 15];
+	}
+	return ~crc;
+}
+
+static uint32_t crc_list[64];
+
+// type = 0: bytes of memory, else sectors read by this flash command,
+// one CRC for every "step" sectors (0 = the whole range)
+static void cmd_crc32(uint32_t type, uint32_t addr, uint32_t len, uint32_t step) {
+	uint32_t n, i = 0, k = 0, crc = 0;
+	uint8_t *buf_addr = (uint8_t*)0x11a000;
+
+	if (!type) step <<= 9;
+	if (!step) step = len;
 	for (; len; addr += n, len -= n) {
 		n = len;
-		if (n > blk_size) n = blk_size;
-		if (cmd == 0x80) {
-			flash_fn(cmd, addr, n, buf_addr);
-			usb_send_buf(buf_addr, n << 9);
+		if (n > step - k) n = step - k;
+		if (!type) {
+			if (n > 0x1000) n = 0x1000;
+			crc = crc32_update(crc, (uint8_t*)addr, n);
+			wd_clear();
 		} else {
-			usb_recv_buf(buf_addr, n << 9);
-			if (cmd != 0xff)
-				flash_fn(cmd, addr, n, buf_addr);
+			if (n > blk_size) n = blk_size;
+			flash_fn(type, addr, n, buf_addr);
+			crc = crc32_update(crc, buf_addr, n << 9);
+		}
+		k += n;
+		if (k == step || n == len) {
+			crc_list[i++] = crc;
+			crc = k = 0;
+			if (i == sizeof(crc_list) / 4 && n != len) {
+				// the rest of the range isn't covered
+				usbs_error = 1;
+				break;
+			}
 		}
 	}
+	usb_send_buf(crc_list, i * 4);
+}
+
+static void copy_mem(uint8_t *dst, const uint8_t *src, uint32_t n) {
+	if (!(((uint32_t)dst | (uint32_t)src | n) & 3)) {
+		uint32_t *d = (uint32_t*)dst;
+		const uint32_t *s = (const uint32_t*)src;
+		for (n >>= 2; n; n--) *d++ = *s++;
+	} else while (n--) *dst++ = *src++;
+}
+
+// the buffer itself holds the copied data, so it reads as zeros
+static void copy_src(uint8_t *dst, uint32_t src, uint32_t n) {
+	uint32_t lo = 0x11a000, p = src, k = 0, m;
+
+	if (p < lo) {
+		k = lo - p < n ? lo - p : n;
+		copy_mem(dst, (uint8_t*)src, k);
+	}
+	if (p + k < lo + 0x4000) {
+		m = lo + 0x4000 - (p + k);
+		if (m > n - k) m = n - k;
+		for (; m; m--) dst[k++] = 0;
+	}
+	if (k < n) copy_mem(dst + k, (uint8_t*)src + k, n - k);
+}
+
+// reads the memory the DMA can't read (ROM), copying it
+// to one half of the buffer while the other half is sent
+static void cmd_read_copy(uint32_t addr, uint32_t len) {
+	uint32_t n, next, i;
+	uint8_t *buf_addr = (uint8_t*)0x11a000;
+
+	n = len > 0x2000 ? 0x2000 : len;
+	if (n) copy_src(buf_addr, addr, n);
+	for (i = 0; len; addr += n, len -= n, n = next, i ^= 0x2000) {
+		next = len - n;
+		if (next > 0x2000) next = 0x2000;
+		if (!next) {
+			usb_send_buf(buf_addr + i, n);
+			break;
+		}
+		usb_send_start(buf_addr + i, n);
+		copy_src(buf_addr + (i ^ 0x2000), addr + n, next);
+		usb_send_wait();
+	}
+}
+
+static void cmd_exec(uint32_t addr) {
+	void *r; char *p;
+	wd_clear();
+	exec_result = r = ((void* (*)(void))(addr | 1))();
+	p = *(char**)r;
+	if (p[6] == 'N') {
+		uint32_t x = *(uint32_t*)&p[0x58];
+		if (x - 1 < 32) // sanity check (not present in original code)
+			blk_size = x;
+	}
+}
+
+/*
+ * Script: 32-bit words, the opcode in the low byte and "n" in the rest.
+ * 0 - end
+ * 1 <addr> <n words> - store the words
+ * 2 <addr> <value> - add to the word
+ * 3 <addr> - exec
+ * 4 <dst> <src> <len> - copy
+ * 5 <src> <len> - append to the output
+ * 6 <offs> <len> - append from the exec result
+ * 7 <idx> - repeat from the word "idx" n times in total
+ * The output is the data phase, cut or padded with zeros to its length.
+ */
+static uint32_t script_buf[0x100];
+static uint8_t out_buf[512];
+static uint32_t out_fill, out_left;
+
+static void out_append(uint8_t *src, uint32_t n) {
+	uint32_t k;
+	if (n > out_left) n = out_left;
+	out_left -= n;
+	for (; n; src += k, n -= k) {
+		if (!out_fill && n >= sizeof(out_buf)) {
+			// whole packets go without copying
+			k = n & ~(sizeof(out_buf) - 1);
+			usb_send_buf(src, k);
+			continue;
+		}
+		k = sizeof(out_buf) - out_fill;
+		if (k > n) k = n;
+		copy_mem(out_buf + out_fill, src, k);
+		out_fill += k;
+		if (out_fill == sizeof(out_buf)) {
+			usb_send_buf(out_buf, out_fill);
+			out_fill = 0;
+		}
+	}
+}
+
+static void cmd_script(uint32_t len) {
+	uint32_t *p = script_buf, op, n, loop = 0;
+
+	out_fill = 0;
+	out_left = len;
+	for (;;) {
+		op = *p++; n = op >> 8;
+		switch (op & 0xff) {
+		case 1:
+			copy_mem((uint8_t*)p[0], (uint8_t*)(p + 1), n << 2);
+			p += n + 1;
+			continue;
+		case 2: MEM4(p[0]) += p[1]; p += 2; continue;
+		case 3: cmd_exec(*p++); continue;
+		case 4:
+			copy_mem((uint8_t*)p[0], (uint8_t*)p[1], p[2]);
+			p += 3;
+			continue;
+		case 5: out_append((uint8_t*)p[0], p[1]); p += 2; continue;
+		case 6:
+			out_append((uint8_t*)exec_result + p[0], p[1]);
+			p += 2;
+			continue;
+		case 7:
+			if (!loop) loop = n ? n : 1;
+			if (--loop) p = script_buf + *p;
+			else p++;
+			continue;
+		}
+		break;
+	}
+	while (out_left) {
+		n = sizeof(out_buf) - out_fill;
+		if (n > out_left) n = out_left;
+		out_left -= n;
+		while (n--) out_buf[out_fill++] = 0;
+		if (out_fill == sizeof(out_buf)) {
+			usb_send_buf(out_buf, out_fill);
+			out_fill = 0;
+		}
+	}
+	if (out_fill) usb_send_buf(out_buf, out_fill);
 }
 
 static void cmd_vendor(void) {
@@ -170,17 +387,18 @@ static void cmd_vendor(void) {
 		switch_addr = addr | 1;
 		switch_flag = 1;
 		break;
-	case 0x21:
-		wd_clear();
+	case 0x21: cmd_exec(addr); break;
+	case 0x27:
+		if (!switch_flag || switch_flag == 3) {
+			switch_addr = addr;
+			switch_flag = 2;
+		} else usbs_error = 1;
+		break;
+	case 0x28:
 		{
-			void *r; char *p;
-			exec_result = r = ((void* (*)(void))(addr | 1))();
-			p = *(char**)r;
-			if (p[6] == 'N') {
-				uint32_t x = *(uint32_t*)&p[0x58];
-				if (x - 1 < 32) // sanity check (not present in original code)
-					blk_size = x;
-			}
+			static uint32_t state;
+			state = switch_flag;
+			usb_send_buf(&state, 4);
 		}
 		break;
 	case 0x22: usb_send_buf(&exec_result->size, len); break;
@@ -192,6 +410,15 @@ static void cmd_vendor(void) {
 			usb_send_buf(p, len);
 		}
 		break;
+	case 0x24:
+		cmd_crc32(cmd >> 8 & 0xff, addr, len, cmd >> 16 & 0xff);
+		break;
+	case 0x25: cmd_read_copy(addr, len); break;
+	case 0x26:
+		if (cmd & 0x80) cmd_script(len);
+		else if (len <= sizeof(script_buf)) usb_recv_buf(script_buf, len);
+		else usbs_error = 2;
+		break;
 	case 0x60:
 		cmd_flash((cmd >> 8 & 0xff) | 0xc0, addr, len);
 		break;
@@ -199,6 +426,8 @@ static void cmd_vendor(void) {
 		usbs_error = 2;
 	}
 	ret_usbs();
+	// a failed command doesn't stop adfus, unlike a phase error
+	if (usbs_error == 1) usbs_error = 0;
 }
 
 static void parse_usb_cmd(void) {
@@ -0,0 +1,56 @@
+// LZ4 block format compressor, small and greedy
+
+#define LZ_HASH_BITS 11
+// the hash table takes (2 << LZ_HASH_BITS) bytes
+#define LZ_BOUND(n) ((n) + (n) / 255 + 16)
+
+static uint32_t lz_read32(const uint8_t *p) {
+	return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static uint8_t *lz_copy(uint8_t *d, const uint8_t *s, unsigned n) {
+	while (n--) *d++ = *s++;
+	return d;
+}
+
+static uint8_t *lz_len(uint8_t *d, unsigned n) {
+	for (; n >= 255; n -= 255) *d++ = 255;
+	*d++ = n;
+	return d;
+}
+
+static uint8_t *lz_seq(uint8_t *d, const uint8_t *lit, unsigned n, unsigned len) {
+	*d++ = (n < 15 ? n : 15) << 4 | (len < 15 ? len : 15);
+	if (n >= 15) d = lz_len(d, n - 15);
+	return lz_copy(d, lit, n);
+}
+
+/*
+ * Compresses up to 64K, the output takes at most LZ_BOUND(n) bytes.
+ * Returns the compressed size.
+ */
+static unsigned lz_compress(uint8_t *dst, const uint8_t *src, unsigned n, uint16_t *hash) {
+	unsigned i = 0, anchor = 0, h, ref, len;
+	uint32_t v;
+	uint8_t *d = dst;
+
+	for (h = 0; h < 1u << LZ_HASH_BITS; h++) hash[h] = 0;
+
+	// the last match must start 12 bytes before the end
+	if (n > 12) while (i < n - 12) {
+		v = lz_read32(src + i);
+		h = v * 2654435761u >> (32 - LZ_HASH_BITS);
+		ref = hash[h]; hash[h] = i;
+		if (ref >= i || lz_read32(src + ref) != v) { i++; continue; }
+		// and end 5 bytes before the end
+		for (len = 4; i + len < n - 5; len++)
+			if (src[ref + len] != src[i + len]) break;
+		d = lz_seq(d, src + anchor, i - anchor, len - 4);
+		*d++ = i - ref;
+		*d++ = (i - ref) >> 8;
+		if (len - 4 >= 15) d = lz_len(d, len - 4 - 15);
+		i += len; anchor = i;
+	}
+	d = lz_seq(d, src + anchor, n - anchor, 0);
+	return d - dst;
+}
@@ -0,0 +1,18 @@
+#include <stdint.h>
+#include <stddef.h>
+
+#include "lz.h"
+
+/*
+ * p[3] = hash table, p[4] = src, p[5] = size (64K max), p[6] = dst.
+ * Returns the compressed data or the source if it doesn't compress.
+ */
+void* entry_main(void) {
+	uint32_t *p = (void*)0x11ffe0;
+	unsigned n = p[5], k;
+
+	k = lz_compress((uint8_t*)p[6], (const uint8_t*)p[4], n, (uint16_t*)p[3]);
+	p[0] = k < n ? p[6] : p[4];
+	p[1] = k < n ? k : n;
+	return p;
+}
@@ -1,6 +1,8 @@
 #include <stdint.h>
 #include <stddef.h>
 
+#include "lz.h"
+
 #define MEM4(addr) *(volatile uint32_t*)(addr)
 #define MEM2(addr) *(volatile uint16_t*)(addr)
 #define MEM1(addr) *(volatile uint8_t*)(addr)
@@ -162,6 +164,15 @@ typedef struct {
 static nand_args_t * const nand_args = (void*)0x100920;
 static nand_conf_t * const nand_conf = (void*)0x100934;
 
+// the worst ECC status of the last read (0x3f = uncorrectable)
+static unsigned nand_ecc;
+
+static unsigned nand_ecc_update(void) {
+	unsigned ecc = NAND_REG(4) >> 16 & 0x3f;
+	if (nand_ecc < ecc) nand_ecc = ecc;
+	return ecc;
+}
+
 #if 0
 DEF_CONST_FN(0x14dc, int, nand_read, (void*, const void*))
 #else
@@ -172,6 +183,7 @@ static int nand_read(nand_args_t *args, const nand_conf_t *conf) {
 
 	*(uint32_t*)&args->udata[0] = 0;
 	*(uint32_t*)&args->udata[4] = 0;
+	nand_ecc = 0;
 
 	rsize = conf->rsize << 8;
 	dst = args->buf;
@@ -263,7 +275,7 @@ static int nand_read(nand_args_t *args, const nand_conf_t *conf) {
 					ret = 1;
 					break;
 				}
-				if ((NAND_REG(4) & 0x3f0000) == 0x3f0000) {
+				if (nand_ecc_update() == 0x3f) {
 					ret = 1;
 				}
 				dst += rsize;
@@ -420,6 +432,71 @@ end:
 }
 #endif
 
+// 0 - data, 1 - all 0xff, 2 - all 0x00
+static unsigned page_fill(const uint32_t *p, unsigned n) {
+	uint32_t x = p[0];
+	if (x + 1 > 1) return 0;
+	while (--n) if (*++p != x) return 0;
+	return x ? 1 : 2;
+}
+
+/*
+ * Reads the pages from the list one after another into the ring,
+ * followed by a trailer for each page: udata[8], status, ECC | fill << 8.
+ * Erased and zero pages are dropped, the rest are packed together.
+ * Returns the size of the packed pages.
+ */
+static unsigned nand_batch(uint8_t *dst, const uint32_t *list) {
+	unsigned i, n = list[0], fill, psize = nand_conf->psize;
+	void *buf = nand_args->buf;
+	uint8_t *start = dst;
+	uint32_t *t = (uint32_t*)(dst + n * psize);
+
+	for (i = 0; i < n; i++, t += 4) {
+		wd_clear();
+		nand_args->rowaddr = list[i + 1];
+		nand_args->buf = dst;
+		t[2] = nand_read(nand_args, nand_conf);
+		t[0] = *(uint32_t*)&nand_args->udata[0];
+		t[1] = *(uint32_t*)&nand_args->udata[4];
+		fill = page_fill((uint32_t*)dst, psize >> 2);
+		t[3] = nand_ecc | fill << 8;
+		if (!fill) dst += psize;
+	}
+	nand_args->buf = buf;
+	return dst - start;
+}
+
+/*
+ * Reads the first sectors (readmsk) of each block and stores the blocks
+ * whose first udata halfword matches in the table: block, udata[8].
+ * args: first block, number of blocks, pages per block, readmsk,
+ * mask | value << 16, table capacity.
+ * The table starts with the number of blocks scanned.
+ */
+static unsigned nand_scan(uint32_t *dst, const uint32_t *args) {
+	unsigned i, k = 0, n = args[1], max = args[5];
+	uint32_t readmsk = nand_args->readmsk, block = args[0];
+	uint32_t *t = dst + 1;
+
+	nand_args->readmsk = args[3];
+	for (i = 0; i < n; i++, block++) {
+		wd_clear();
+		nand_args->rowaddr = block * args[2];
+		nand_read(nand_args, nand_conf);
+		if (((*(uint16_t*)nand_args->udata ^ args[4] >> 16) & args[4]) & 0xffff)
+			continue;
+		if (k == max) break;
+		t[0] = block;
+		t[1] = *(uint32_t*)&nand_args->udata[0];
+		t[2] = *(uint32_t*)&nand_args->udata[4];
+		t += 3; k++;
+	}
+	nand_args->readmsk = readmsk;
+	dst[0] = i;
+	return 4 + k * 12;
+}
+
 void* entry_main(void) {
 	uint32_t *p = (void*)0x11ffe0;
 	int ret, flags = p[4];
@@ -485,6 +562,26 @@ void* entry_main(void) {
 		wd_clear();
 		nand_read(nand_args, nand_conf);
 	}
+	// p[6] = ring, p[7] = list (count, rowaddr[count])
+	if (flags & 8) {
+		uint8_t *ring = (void*)p[6];
+		const uint32_t *list = (const uint32_t*)p[7];
+		unsigned n = nand_batch(ring, list);
+		// p[3] = hash table, compressed after the trailers
+		if (flags & 0x20) {
+			uint8_t *dst = ring + list[0] * (nand_conf->psize + 16);
+			unsigned k = lz_compress(dst, ring, n, (uint16_t*)p[3]);
+			p[0] = (uint32_t)dst;
+			p[1] = k < n ? k : 0;
+		}
+		p[4] = 4;
+	}
+	// p[6] = table, p[7] = scan args
+	if (flags & 0x10) {
+		p[0] = p[6];
+		p[1] = nand_scan((uint32_t*)p[6], (const uint32_t*)p[7]);
+		p[4] = 4;
+	}
 end:
 	if (flags & 0x80) {
 		NAND_REG(0) &= ~0x78;